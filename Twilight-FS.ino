@@ -21,8 +21,10 @@
 #include <spi_flash.h>
 #include <user_interface.h>
 #include "tfs.h"
+#include "tfs_kv.h"
 
 TFS tfs;
+TFS_KV settings;
 
 //
 // TFS HAL function implementation for ESP
@@ -85,24 +87,41 @@ void showDir(void)
 
 bool addSetting(const char *name, const char *value)
 {
-	TFS::File fh;
-	if (!tfs.open("settings", fh, true)) return false;
-	fh.write(name, strlen(name));
-	fh.write("=", 1);
-	fh.write(value, strlen(value));
-	fh.write("\n", 1);
-	fh.close();
+	return settings.put(name, value, strlen(value));
 }
 
-void printSettings()
+// older version of this example kept name=value lines in "settings" file,
+// they are moved to the store and the file is removed
+void migrateSettings()
 {
 	TFS::File fh;
-	char c;
 	if (!tfs.open("settings", fh)) return;
+	char line[TFS_KV_KEY_MAX + 66];
+	int n = 0, c;
 	while ((c = fh.read()) >= 0) {
-		debuglog("%c", c);
+		if (c != '\n') {
+			if (n < (int)sizeof(line) - 1) line[n++] = c;
+			continue;
+		}
+		line[n] = 0;
+		n = 0;
+		char *v = strchr(line, '=');
+		if (!v) continue;
+		*v++ = 0;
+		settings.put(line, v, strlen(v));
 	}
 	fh.close();
+	tfs.remove("settings");
+}
+
+void printSettings()
+{
+	char name[TFS_KV_KEY_MAX + 1], value[64];
+	for (int it = settings.next(-1, name); it >= 0; it = settings.next(it, name)) {
+		int len = settings.get(name, value, sizeof(value) - 1);
+		value[len < 0 ? 0 : len] = 0;
+		debuglog("%s=%s\n", name, value);
+	}
 }
 
 //
@@ -118,6 +137,8 @@ void setup() {
 		tfs.format();
 		debuglog("tfs formated\n");
 	}
+	if (settings.open(tfs, "kvsettings")) migrateSettings();
+	else debuglog("can't open settings\n");
 	addSetting("Hello", "World");
 	showDir();
 	printSettings();
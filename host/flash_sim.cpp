@@ -0,0 +1,285 @@
+// Twilight File System - host NOR flash simulator
+//
+// with TFS_USE_LOCKS reads, maps and yields run in parallel under shared lock,
+// simulated time they touch is accessed atomically, program and erase
+// accounting relies on exclusive lock
+//
+// Copyright(C) 2017. Nebojsa Sumrak <nsumrak@yahoo.com>
+//
+//   This program is free software; you can redistribute it and / or modify
+//	 it under the terms of the GNU General Public License as published by
+//	 the Free Software Foundation; either version 2 of the License, or
+//	 (at your option) any later version.
+//
+//	 This program is distributed in the hope that it will be useful,
+//	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+//	 GNU General Public License for more details.
+//
+//	 You should have received a copy of the GNU General Public License along
+//	 with this program; if not, write to the Free Software Foundation, Inc.,
+//	 51 Franklin Street, Fifth Floor, Boston, MA 02110 - 1301 USA.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "flash_sim.h"
+
+static unsigned char *_mem;
+static unsigned int _size;
+static bool _mapped; // image file is mapped to _mem
+static unsigned long long _time;
+static unsigned long long _erase_end; // end of background erase
+static unsigned long long _read_end; // end of background read
+static unsigned int _read_src, _read_size;
+static unsigned int *_read_des; // data is copied when read is done
+static short _lbe;
+static flash_sim_stats _stats;
+static flash_sim_timing _timing = {
+	5000,		// read setup 5us
+	50,			// ~20MB/s read
+	30000,		// first byte program 30us
+	2500,		// each next byte 2.5us (256B page ~0.67ms)
+	45000000,	// sector erase 45ms
+	120000000,	// 32KB block erase 120ms
+	150000000,	// 64KB block erase 150ms
+	10000000000ull	// chip erase (4MB) 10s
+};
+
+// reads can be done from several threads at once (TFS_USE_LOCKS)
+static inline void add(unsigned long long &v, unsigned long long n)
+{
+	__atomic_fetch_add(&v, n, __ATOMIC_RELAXED);
+}
+
+static inline unsigned long long now()
+{
+	return __atomic_load_n(&_time, __ATOMIC_RELAXED);
+}
+
+// move simulated time to at least t, other thread may have moved it further
+static inline void wait_until(unsigned long long t)
+{
+	unsigned long long cur = now();
+	while (cur < t && !__atomic_compare_exchange_n(&_time, &cur, t, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) ;
+}
+
+static void check_range(const char *op, unsigned int addr, unsigned int size)
+{
+	if (addr + size > _size || addr + size < addr) {
+		fprintf(stderr, "flash_sim: %s out of range addr:%08x size:%u\n", op, addr, size);
+		abort();
+	}
+	if ((addr | size) & 3) add(_stats.unaligned, 1);
+	if (now() < _erase_end || _read_des) add(_stats.busy, 1);
+}
+
+// image file is mapped shared, so flash content is in it as it is written,
+// part of flash over end of old image is erased
+static unsigned char *map_image(const char *image, unsigned int size)
+{
+	int fd = open(image, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) return 0;
+	off_t old = lseek(fd, 0, SEEK_END);
+	if (old < 0 || ftruncate(fd, size)) {
+		close(fd);
+		return 0;
+	}
+	void *m = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) return 0;
+	if (old < (off_t)size) memset((unsigned char *)m + old, 0xff, size - old);
+	return (unsigned char *)m;
+}
+
+bool flash_sim_open(unsigned int size, const char *image)
+{
+	flash_sim_close();
+	_mapped = image;
+	_mem = image ? map_image(image, size) : (unsigned char *)malloc(size);
+	if (!_mem) return false;
+	_size = size;
+	if (!image) memset(_mem, 0xff, size);
+	_time = _erase_end = _read_end = 0;
+	_read_des = 0;
+	_lbe = 0;
+	flash_sim_reset_stats();
+	return true;
+}
+
+void flash_sim_close()
+{
+	if (!_mem) return;
+	if (_mapped) munmap(_mem, _size);
+	else free(_mem);
+	_mem = 0;
+}
+
+void flash_sim_set_timing(const flash_sim_timing &t)
+{
+	_timing = t;
+}
+
+const flash_sim_timing &flash_sim_get_timing()
+{
+	return _timing;
+}
+
+const flash_sim_stats &flash_sim_get_stats()
+{
+	return _stats;
+}
+
+void flash_sim_reset_stats()
+{
+	memset(&_stats, 0, sizeof(_stats));
+}
+
+unsigned long long flash_sim_time()
+{
+	return now();
+}
+
+void flash_sim_advance(unsigned long long ns)
+{
+	_time += ns;
+}
+
+short flash_sim_last_block_erased()
+{
+	return _lbe;
+}
+
+//
+// TFS HAL implementation
+//
+
+int flash_read(unsigned int src_addr, unsigned int * des_addr, unsigned int size)
+{
+	check_range("read", src_addr, size);
+	memcpy(des_addr, _mem + src_addr, size);
+	add(_stats.reads, 1);
+	add(_stats.read_bytes, size);
+	add(_time, _timing.read_setup + (unsigned long long)_timing.read_byte * size);
+	return 0;
+}
+
+int flash_write(unsigned int des_addr, unsigned int *src_addr, unsigned int size)
+{
+	check_range("write", des_addr, size);
+	const unsigned char *s = (const unsigned char *)src_addr;
+	unsigned char *d = _mem + des_addr;
+	for (unsigned int i = 0; i < size; i++) {
+		// 0xff leaves byte as is, anything else has to be storable
+		if (s[i] != 0xff && (s[i] & ~d[i])) _stats.nor_violations++;
+		d[i] &= s[i];
+	}
+	// program is done in chunks which do not cross program page
+	for (unsigned int a = des_addr, end = des_addr + size; a < end; ) {
+		unsigned int n = FLASH_SIM_PROG_PAGE - (a % FLASH_SIM_PROG_PAGE);
+		if (n > end - a) n = end - a;
+		_time += _timing.prog_setup + (unsigned long long)_timing.prog_byte * (n - 1);
+		_stats.prog_pages++;
+		a += n;
+	}
+	_stats.writes++;
+	_stats.write_bytes += size;
+	return 0;
+}
+
+int flash_erase_sector(unsigned short sec)
+{
+	check_range("erase", (unsigned int)sec * FLASH_SIM_SECTOR, FLASH_SIM_SECTOR);
+	memset(_mem + (unsigned int)sec * FLASH_SIM_SECTOR, 0xff, FLASH_SIM_SECTOR);
+	_stats.erases++;
+	_time += _timing.erase_sector;
+	return 0;
+}
+
+int flash_erase_start(unsigned short sec)
+{
+	check_range("erase", (unsigned int)sec * FLASH_SIM_SECTOR, FLASH_SIM_SECTOR);
+	memset(_mem + (unsigned int)sec * FLASH_SIM_SECTOR, 0xff, FLASH_SIM_SECTOR);
+	_stats.erases++;
+	_erase_end = _time + _timing.erase_sector;
+	return 0;
+}
+
+// 32KB or 64KB block aligned to its size or whole chip (size 0)
+int flash_erase_bulk(unsigned short sec, unsigned int size, bool wait)
+{
+	unsigned int addr = (unsigned int)sec * FLASH_SIM_SECTOR;
+	unsigned long long t;
+	if (!size) {
+		addr = 0;
+		size = _size;
+		t = _timing.erase_chip;
+	}
+	else if ((size == 32768 || size == 65536) && !(addr % size))
+		t = size == 32768 ? _timing.erase_block32 : _timing.erase_block64;
+	else return -1;
+	check_range("erase", addr, size);
+	memset(_mem + addr, 0xff, size);
+	_stats.erases++;
+	if (wait) _time += t;
+	else _erase_end = _time + t;
+	return 0;
+}
+
+bool flash_erase_done()
+{
+	return now() >= _erase_end;
+}
+
+int flash_read_start(unsigned int src_addr, unsigned int *des_addr, unsigned int size)
+{
+	check_range("read", src_addr, size);
+	_read_src = src_addr;
+	_read_des = des_addr;
+	_read_size = size;
+	_stats.reads++;
+	_stats.read_bytes += size;
+	_read_end = now() + _timing.read_setup + (unsigned long long)_timing.read_byte * size;
+	return 0;
+}
+
+bool flash_read_done()
+{
+	if (now() < _read_end) return false;
+	if (_read_des) memcpy(_read_des, _mem + _read_src, _read_size);
+	_read_des = 0;
+	return true;
+}
+
+// nothing else to do, wait for background erase or read
+void do_yield()
+{
+	wait_until(_erase_end);
+	wait_until(_read_end);
+}
+
+// flash is mapped as it is, access while erase or read is in progress
+// would fault on real part, bytes are charged as read through cache (without
+// command and address)
+const void *flash_map(unsigned int addr, unsigned int size)
+{
+	if (addr + size > _size || addr + size < addr) return 0;
+	if (now() < _erase_end || _read_des) add(_stats.busy, 1);
+	add(_stats.maps, 1);
+	add(_time, (unsigned long long)_timing.read_byte * size);
+	return _mem + addr;
+}
+
+// simulated time for TFS_USE_STATS_CLOCK
+unsigned int tfs_clock()
+{
+	return (unsigned int)(now() / 1000);
+}
+
+void set_last_block_erased(short lbe)
+{
+	_lbe = lbe;
+}
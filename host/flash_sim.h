@@ -0,0 +1,72 @@
+// Twilight File System - host NOR flash simulator
+//
+// implements TFS HAL (flash_read, flash_write, flash_erase_sector, do_yield,
+// set_last_block_erased, flash_erase_start, flash_erase_done, flash_erase_bulk,
+// flash_read_start, flash_read_done, flash_map, tfs_clock) on top of RAM or
+// mapped image file with NOR semantics: program can only clear bits and
+// erase works on whole 4KB sectors. every operation
+// advances simulated clock using configurable timing model, erase or read
+// started in background ends after its time of simulated clock (data of read
+// is copied only then), do_yield waits for it.
+//
+// Copyright(C) 2017. Nebojsa Sumrak <nsumrak@yahoo.com>
+//
+//   This program is free software; you can redistribute it and / or modify
+//	 it under the terms of the GNU General Public License as published by
+//	 the Free Software Foundation; either version 2 of the License, or
+//	 (at your option) any later version.
+//
+//	 This program is distributed in the hope that it will be useful,
+//	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+//	 GNU General Public License for more details.
+//
+//	 You should have received a copy of the GNU General Public License along
+//	 with this program; if not, write to the Free Software Foundation, Inc.,
+//	 51 Franklin Street, Fifth Floor, Boston, MA 02110 - 1301 USA.
+
+#pragma once
+
+#define FLASH_SIM_SECTOR	4096
+#define FLASH_SIM_PROG_PAGE	256
+
+// costs in nanoseconds, defaults are typical for 4MB SPI NOR on ESP8266
+struct flash_sim_timing {
+	unsigned int read_setup;	// command + address per flash_read
+	unsigned int read_byte;
+	unsigned int prog_setup;	// per program page touched
+	unsigned int prog_byte;
+	unsigned int erase_sector;
+	unsigned int erase_block32, erase_block64;	// 32KB and 64KB block erase
+	unsigned long long erase_chip;
+};
+
+struct flash_sim_stats {
+	unsigned long long reads, read_bytes;
+	unsigned long long writes, write_bytes, prog_pages;
+	unsigned long long erases;
+	unsigned long long maps;			// flash_map calls, bytes mapped aren't counted as read
+	unsigned long long nor_violations;	// bytes which could not be stored (0 to 1 flip)
+	unsigned long long unaligned;		// address or size not multiple of 4
+	unsigned long long busy;			// access while background erase or read is in progress
+};
+
+// size of simulated flash in bytes (multiple of sector)
+// image: when not null, that file is mapped and keeps flash content
+bool flash_sim_open(unsigned int size, const char *image = 0);
+void flash_sim_close();
+
+void flash_sim_set_timing(const flash_sim_timing &t);
+const flash_sim_timing &flash_sim_get_timing();
+
+const flash_sim_stats &flash_sim_get_stats();
+void flash_sim_reset_stats();
+
+// simulated time since open
+unsigned long long flash_sim_time();
+
+// advance simulated clock by CPU work done meanwhile (nanoseconds)
+void flash_sim_advance(unsigned long long ns);
+
+// value last passed to set_last_block_erased
+short flash_sim_last_block_erased();
@@ -0,0 +1,1082 @@
+// Twilight File System - benchmark on host flash simulator
+//
+// runs typical workloads (format, mount, create/remove churn, open/read/close
+// cycles, append-heavy logging) and reports flash operation counts, bytes
+// moved and simulated latency percentiles per operation
+//
+// Copyright(C) 2017. Nebojsa Sumrak <nsumrak@yahoo.com>
+//
+//   This program is free software; you can redistribute it and / or modify
+//	 it under the terms of the GNU General Public License as published by
+//	 the Free Software Foundation; either version 2 of the License, or
+//	 (at your option) any later version.
+//
+//	 This program is distributed in the hope that it will be useful,
+//	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+//	 GNU General Public License for more details.
+//
+//	 You should have received a copy of the GNU General Public License along
+//	 with this program; if not, write to the Free Software Foundation, Inc.,
+//	 51 Franklin Street, Fifth Floor, Boston, MA 02110 - 1301 USA.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include "flash_sim.h"
+#include "../tfs.h"
+#include "../tfs_kv.h"
+
+TFS tfs;
+
+// second file system in unused part of firmware area with own geometry,
+// wear leveling position of main one isn't overwritten by it
+struct part_config : tfs_config
+{
+	enum { num_blocks = 16, flash_offs = 512 * 1024, cache_lines = 1 };
+	static void set_last_block_erased(short) {}
+};
+
+typedef TFS_T<part_config> PART;
+static PART part;
+
+// the same area with other block size, format differs
+struct other_config : part_config
+{
+	enum { page_size = TFS_PAGE_SIZE == 4096 ? 8192 : 4096, num_blocks = 8 * TFS_PAGE_SIZE / page_size };
+};
+
+static TFS_T<other_config> other;
+
+static unsigned int _seed = 1;
+static int _errors;
+
+// own generator so runs are reproducible on any libc
+static unsigned int rnd(unsigned int n)
+{
+	_seed = _seed * 1103515245 + 12345;
+	return ((_seed >> 16) & 0x7fff) % n;
+}
+
+//
+// measurement
+//
+
+class Bench
+{
+	const char *_name;
+	flash_sim_stats _st;
+	unsigned long long _start, _op;
+	std::vector<unsigned long long> _lat;
+
+public:
+	Bench(const char *name) : _name(name)
+	{
+		_st = flash_sim_get_stats();
+		_start = flash_sim_time();
+	}
+
+	void begin()
+	{
+		_op = flash_sim_time();
+	}
+
+	void end()
+	{
+		_lat.push_back(flash_sim_time() - _op);
+	}
+
+	static void header()
+	{
+		printf("%-16s %7s %8s %10s %7s %10s %6s %10s %8s %8s %8s %8s\n",
+			"scenario", "ops", "reads", "rd bytes", "writes", "wr bytes", "erase",
+			"total ms", "p50 us", "p90 us", "p99 us", "max us");
+	}
+
+	void report()
+	{
+		const flash_sim_stats &s = flash_sim_get_stats();
+		std::sort(_lat.begin(), _lat.end());
+		size_t n = _lat.size();
+		printf("%-16s %7u %8llu %10llu %7llu %10llu %6llu %10.1f %8.0f %8.0f %8.0f %8.0f\n",
+			_name, (unsigned)n,
+			s.reads - _st.reads, s.read_bytes - _st.read_bytes,
+			s.writes - _st.writes, s.write_bytes - _st.write_bytes,
+			s.erases - _st.erases,
+			(flash_sim_time() - _start) / 1e6,
+			pct(0.50) / 1e3, pct(0.90) / 1e3, pct(0.99) / 1e3, n ? _lat[n - 1] / 1e3 : 0.0);
+	}
+
+private:
+	double pct(double q)
+	{
+		if (_lat.empty()) return 0;
+		return (double)_lat[(size_t)((_lat.size() - 1) * q)];
+	}
+};
+
+//
+// file content, deterministic per file and generation, never 0xff so
+// variable size files keep their length on reopen
+//
+
+#define MAX_FILES	1000
+
+static int _nfiles = 200;
+static int _gen[MAX_FILES];
+static int _size[MAX_FILES];
+
+static char content(int id, int pos)
+{
+	return (char)((id * 31 + _gen[id] * 7 + pos) % 255);
+}
+
+static void file_name(int id, char *buf)
+{
+	sprintf(buf, "f%03d", id);
+}
+
+static bool write_file(int id, int size)
+{
+	char name[TFS_NAME_SIZE + 1], buf[128];
+	TFS::File fh;
+	file_name(id, name);
+	_gen[id]++;
+	_size[id] = size;
+	if (!tfs.create(name, fh)) return false;
+	for (int pos = 0; pos < size; ) {
+		int n = size - pos;
+		if (n > (int)sizeof(buf)) n = sizeof(buf);
+		for (int i = 0; i < n; i++) buf[i] = content(id, pos + i);
+		if (fh.write(buf, n) != n) return false;
+		pos += n;
+	}
+	fh.close();
+	return true;
+}
+
+static bool read_file(int id, int chunk)
+{
+	char name[TFS_NAME_SIZE + 1], buf[4096];
+	TFS::File fh;
+	file_name(id, name);
+	if (!tfs.open(name, fh)) return false;
+	int pos = 0, n;
+	while ((n = fh.read(buf, chunk)) > 0) {
+		for (int i = 0; i < n; i++)
+			if (buf[i] != content(id, pos + i)) {
+				fh.close();
+				return false;
+			}
+		pos += n;
+	}
+	fh.close();
+	return pos == _size[id];
+}
+
+static void check(bool ok, const char *what, int id)
+{
+	if (ok) return;
+	if (_errors++ < 10) fprintf(stderr, "error: %s %d failed\n", what, id);
+}
+
+//
+// scenarios
+//
+
+static void bench_format()
+{
+	Bench b("format");
+	b.begin();
+	tfs.format();
+	b.end();
+	b.report();
+}
+
+static void bench_mount(const char *name, int count)
+{
+	Bench b(name);
+	for (int i = 0; i < count; i++) {
+		b.begin();
+		check(tfs.init(flash_sim_last_block_erased()), "mount", i);
+		b.end();
+	}
+	b.report();
+}
+
+// flush and write checkpoint as before shutdown
+static void bench_sync()
+{
+	Bench b("sync");
+	b.begin();
+	tfs.sync();
+	b.end();
+	b.report();
+}
+
+static void bench_create()
+{
+	Bench b("create");
+	for (int id = 0; id < _nfiles; id++) {
+		b.begin();
+		check(write_file(id, 20 + rnd(2000)), "create", id);
+		b.end();
+	}
+	b.report();
+}
+
+static void bench_open(int count)
+{
+	Bench b("open/close");
+	char name[TFS_NAME_SIZE + 1];
+	for (int i = 0; i < count; i++) {
+		int id = rnd(_nfiles);
+		TFS::File fh;
+		file_name(id, name);
+		b.begin();
+		check(tfs.open(name, fh), "open", id);
+		fh.close();
+		b.end();
+	}
+	b.report();
+}
+
+static void bench_read(int count, int chunk)
+{
+	Bench b("open/read/close");
+	for (int i = 0; i < count; i++) {
+		int id = rnd(_nfiles);
+		b.begin();
+		check(read_file(id, chunk), "read", id);
+		b.end();
+	}
+	b.report();
+}
+
+// read back every file after mount
+static void bench_verify()
+{
+	Bench b("verify all");
+	for (int id = 0; id < _nfiles; id++) {
+		b.begin();
+		check(read_file(id, 512), "verify", id);
+		b.end();
+	}
+	b.report();
+}
+
+static void bench_churn(int count)
+{
+	Bench b("create/remove");
+	char name[TFS_NAME_SIZE + 1];
+	for (int i = 0; i < count; i++) {
+		int id = rnd(_nfiles);
+		b.begin();
+		if (rnd(4)) check(write_file(id, 20 + rnd(300)), "churn create", id);
+		else {
+			file_name(id, name);
+			tfs.remove(name);
+			_size[id] = -1;
+		}
+		b.end();
+	}
+	b.report();
+	// recreate removed files so later scenarios can read all of them
+	for (int id = 0; id < _nfiles; id++)
+		if (_size[id] < 0) check(write_file(id, 20 + rnd(300)), "churn create", id);
+}
+
+// random reads from large file, optionally with chain index
+static void bench_seek(const char *name, int count, int size, bool indexed)
+{
+	unsigned short chain[128];
+	char buf[64];
+	TFS::File fh;
+	Bench b(name);
+	b.begin();
+	check(tfs.open("media", fh), "media open", 0);
+	if (indexed) fh.set_chain_index(chain, 128, 1);
+	b.end();
+	for (int i = 0; i < count; i++) {
+		int pos = rnd(size - sizeof(buf));
+		b.begin();
+		bool ok = fh.seek(pos) && fh.read(buf, sizeof(buf)) == sizeof(buf);
+		b.end();
+		for (int j = 0; ok && j < (int)sizeof(buf); j++)
+			if (buf[j] != (char)((pos + j) % 251)) ok = false;
+		check(ok, "media seek", pos);
+	}
+	fh.close();
+	b.report();
+}
+
+// temporary files created and removed with background work done between
+// them, directory fills with deleted entries and has to be compacted
+static void bench_dir_churn(int count)
+{
+	Bench b("create tmp"), st("tmp step");
+	char name[16], buf[16];
+	TFS::File fh;
+	memset(buf, 't', sizeof(buf));
+	for (int i = 0; i < count; i++) {
+		sprintf(name, "tmp%d", i);
+		b.begin();
+		check(tfs.create(name, fh), "tmp create", i);
+		b.end();
+		fh.write(buf, sizeof(buf));
+		fh.close();
+		tfs.remove(name);
+		st.begin();
+		while (tfs.step()) do_yield();
+		st.end();
+	}
+	b.report();
+	st.report();
+}
+
+// large file streamed while telemetry records are appended to other file,
+// through shared cache or with own buffer per handle
+static void bench_interleave(const char *name, int size, int chunk, bool buffered)
+{
+	char align4 rbuf[1024], wbuf[512];
+	char buf[4096], rec[32];
+	TFS::File fh, log;
+	Bench b(name);
+	check(tfs.open("media", fh), "media open", 0);
+	check(tfs.create("telemetry", log), "telemetry create", 0);
+	if (buffered) {
+		fh.set_buffer(rbuf, sizeof(rbuf));
+		log.set_buffer(wbuf, sizeof(wbuf));
+	}
+	int pos = 0, records = 0;
+	while (true) {
+		b.begin();
+		int n = fh.read(buf, chunk);
+		b.end();
+		if (n <= 0) break;
+		for (int i = 0; i < n; i++)
+			if (buf[i] != (char)((pos + i) % 251)) {
+				check(false, "media read", pos + i);
+				break;
+			}
+		pos += n;
+		// record per 256 bytes of audio
+		for (int i = 0; i < n; i += 256) {
+			sprintf(rec, "%08d", records++);
+			memset(rec + 8, 't', sizeof(rec) - 9);
+			rec[sizeof(rec) - 1] = '\n';
+			b.begin();
+			check(log.write(rec, sizeof(rec)) == sizeof(rec), "telemetry write", records);
+			b.end();
+		}
+	}
+	fh.close();
+	log.close();
+	b.report();
+	check(pos == size, "media size", pos);
+	check(tfs.get_size("telemetry") == records * (int)sizeof(rec), "telemetry size", records);
+	check(tfs.open("telemetry", log), "telemetry open", 0);
+	for (int i = 0; i < records; i++) {
+		bool ok = log.read(rec, sizeof(rec)) == sizeof(rec) && atoi(rec) == i;
+		if (!ok) {
+			check(false, "telemetry read", i);
+			break;
+		}
+	}
+	log.close();
+	tfs.remove("telemetry");
+}
+
+// playback with own buffer, each chunk is decoded for a while before next
+// read, with read-ahead next window is read meanwhile (TFS_USE_ASYNC_READ)
+static void bench_decode(const char *name, int size, int chunk, bool read_ahead)
+{
+	char align4 rbuf[2048];
+	char buf[1024];
+	TFS::File fh;
+	Bench b(name);
+	check(tfs.open("media", fh), "media open", 0);
+	// same window size in both cases
+	fh.set_buffer(rbuf, read_ahead ? 2048 : 1024, read_ahead);
+	int pos = 0;
+	while (true) {
+		b.begin();
+		int n = fh.read(buf, chunk);
+		b.end();
+		if (n <= 0) break;
+		for (int i = 0; i < n; i++)
+			if (buf[i] != (char)((pos + i) % 251)) {
+				check(false, "media read", pos + i);
+				break;
+			}
+		pos += n;
+		flash_sim_advance(100000);
+	}
+	fh.close();
+	fh.set_buffer(0, 0);
+	b.report();
+	check(pos == size, "media size", pos);
+}
+
+#ifdef TFS_USE_FLASH_MAP
+// playback as in decode, chunk is decoded in place from mapped flash
+static void bench_map(const char *name, int size, int chunk)
+{
+	TFS::File fh;
+	Bench b(name);
+	check(tfs.open("media", fh), "media open", 0);
+	int pos = 0;
+	while (true) {
+		int n = chunk;
+		b.begin();
+		const char *p = fh.map(n);
+		b.end();
+		if (!p) break;
+		for (int i = 0; i < n; i++)
+			if (p[i] != (char)((pos + i) % 251)) {
+				check(false, "media map", pos + i);
+				break;
+			}
+		pos += n;
+		flash_sim_advance(100000);
+	}
+	fh.close();
+	b.report();
+	check(pos == size, "media size", pos);
+
+	// variable size file mapped while appended data is still in write cache
+	char buf[300];
+	TFS::File wr;
+	check(tfs.create("mapped", wr), "mapped create", 0);
+	for (int k = 0; k < 20; k++) {
+		for (int i = 0; i < (int)sizeof(buf); i++) buf[i] = (char)((k * sizeof(buf) + i) % 251);
+		wr.write(buf, sizeof(buf));
+	}
+	check(tfs.open("mapped", fh), "mapped open", 0);
+	pos = 0;
+	int n = TFS_BLOCK_SIZE;
+	for (const char *p; (p = fh.map(n)); n = TFS_BLOCK_SIZE) {
+		for (int i = 0; i < n; i++)
+			if (p[i] != (char)((pos + i) % 251)) {
+				check(false, "mapped data", pos + i);
+				break;
+			}
+		pos += n;
+	}
+	check(pos == 20 * (int)sizeof(buf), "mapped size", pos);
+	fh.close();
+	wr.close();
+	tfs.remove("mapped");
+}
+#endif
+
+// large file read sequentially in chunks, like audio playback
+static void bench_stream(int size, int passes, int chunk)
+{
+	char buf[4096];
+	TFS::File fh;
+	check(tfs.create("media", fh), "media create", 0);
+	for (int pos = 0; pos < size; pos += sizeof(buf)) {
+		for (int i = 0; i < (int)sizeof(buf); i++) buf[i] = (char)((pos + i) % 251);
+		fh.write(buf, sizeof(buf));
+	}
+	fh.close_fixed();
+
+	Bench b("stream read");
+	for (int p = 0; p < passes; p++) {
+		check(tfs.open("media", fh), "media open", p);
+		int pos = 0;
+		while (true) {
+			b.begin();
+			int n = fh.read(buf, chunk);
+			b.end();
+			if (n <= 0) break;
+			for (int i = 0; i < n; i++)
+				if (buf[i] != (char)((pos + i) % 251)) {
+					check(false, "media read", pos + i);
+					break;
+				}
+			pos += n;
+		}
+		check(pos == size, "media size", pos);
+		fh.close();
+	}
+	b.report();
+	bench_seek("random seek", 1000, size, false);
+	bench_seek("seek indexed", 1000, size, true);
+	bench_interleave("interleaved", size, 128, false);
+	bench_interleave("own buffers", size, 128, true);
+	bench_decode("decode", size, 256, false);
+	bench_decode("decode ahead", size, 256, true);
+#ifdef TFS_USE_FLASH_MAP
+	bench_map("decode mapped", size, 256);
+#endif
+	tfs.remove("media");
+}
+
+// append records to log reopening it periodically, when filesystem is
+// full log is removed and started again which forces inline erases
+// unless blocks are erased in idle time between records
+static void bench_log(int records, int recsize, bool idle)
+{
+	Bench b(idle ? "log idle erase" : "append log");
+	char rec[256];
+	// log is kept from previous run unless it filled flash
+	int logsize = tfs.get_size("log");
+	if (logsize < 0) logsize = 0;
+	TFS::File fh;
+	check(tfs.open("log", fh, true), "log open", 0);
+	for (int i = 0; i < records; i++) {
+		for (int j = 0; j < recsize - 1; j++) rec[j] = 'a' + (i + j) % 26;
+		rec[recsize - 1] = '\n';
+		if (tfs.freespace() < 2 * TFS_BLOCK_SIZE) {
+			fh.close();
+			tfs.remove("log");
+			check(tfs.open("log", fh, true), "log create", i);
+			logsize = 0;
+		}
+		else if (!(i % 100)) {
+			fh.close();
+			check(tfs.open("log", fh), "log reopen", i);
+		}
+		b.begin();
+		check(fh.write(rec, recsize) == recsize, "log write", i);
+		b.end();
+		logsize += recsize;
+		if (idle && tfs.erase_needed()) tfs.erase_idle(1);
+	}
+	fh.close();
+	b.report();
+	check(tfs.get_size("log") == logsize, "log size", logsize);
+}
+
+// periodic loop: record is appended every 50ms and filesystem does its
+// background work in step() between records, log is removed when
+// filesystem is full, so writes rely on blocks erased by step()
+static void bench_worker(int records, int recsize)
+{
+	Bench b("worker write"), st("worker step");
+	char rec[4096];
+	TFS::File fh;
+	check(tfs.create("wlog", fh), "worker create", 0);
+	for (int i = 0; i < records; i++) {
+		memset(rec, 'a' + i % 26, recsize - 1);
+		rec[recsize - 1] = '\n';
+		if (tfs.freespace() < 2 * TFS_BLOCK_SIZE) {
+			fh.close();
+			tfs.remove("wlog");
+			check(tfs.create("wlog", fh), "worker create", i);
+		}
+		b.begin();
+		check(fh.write(rec, recsize) == recsize, "worker write", i);
+		b.end();
+		st.begin();
+		tfs.step();
+		st.end();
+		flash_sim_advance(50000000);
+	}
+	fh.close();
+	tfs.remove("wlog");
+	while (tfs.step()) do_yield();
+	b.report();
+	st.report();
+}
+
+// append records to ring file limited to few blocks, oldest block is
+// dropped instead of removing whole log, then read back from oldest record
+static void bench_ring(int records, int recsize, int blocks)
+{
+	Bench b("ring log");
+	char rec[256];
+	TFS::File fh;
+	check(tfs.create_ring("ring", fh, blocks), "ring create", 0);
+	for (int i = 0; i < records; i++) {
+		memset(rec, 'r', recsize - 1);
+		sprintf(rec, "%08d", i);
+		rec[8] = ' ';
+		rec[recsize - 1] = '\n';
+		b.begin();
+		check(fh.write(rec, recsize) == recsize, "ring write", i);
+		b.end();
+		if (tfs.erase_needed()) tfs.erase_idle(1);
+	}
+	fh.close();
+	b.report();
+
+	// records are contiguous up to the last one, zeroes at the end of block skipped
+	check(tfs.open("ring", fh), "ring open", 0);
+	int next = -1, n, size = 0;
+	while ((n = fh.read(rec, 1)) == 1) {
+		size++;
+		if (!rec[0]) continue;
+		if (fh.read(rec + 1, recsize - 1) != recsize - 1) break;
+		size += recsize - 1;
+		int no = atoi(rec);
+		if (next >= 0 && no != next) break;
+		next = no + 1;
+	}
+	fh.close();
+	check(next == records, "ring read", next);
+	check(size <= blocks * TFS_BLOCK_SIZE && size > (blocks - 1) * TFS_BLOCK_SIZE, "ring size", size);
+	tfs.remove("ring");
+}
+
+// name=value lines appended by four small writes per setting, file is
+// reopened for every setting like in addSetting example
+static void bench_config(int count)
+{
+	Bench b("config append");
+	char name[24], value[16], line[64];
+	TFS::File fh;
+	int size = 0;
+	for (int i = 0; i < count; i++) {
+		sprintf(name, "key%d", i % 50);
+		sprintf(value, "%d", i * 7);
+		b.begin();
+		check(tfs.open("config", fh, true), "config open", i);
+		fh.write(name, strlen(name));
+		fh.write("=", 1);
+		fh.write(value, strlen(value));
+		fh.write("\n", 1);
+		fh.close();
+		b.end();
+		size += strlen(name) + strlen(value) + 2;
+	}
+	b.report();
+	check(tfs.get_size("config") == size, "config size", size);
+	check(tfs.open("config", fh), "config open", 0);
+	for (int i = 0; i < count; i++) {
+		int n = 0;
+		while (n < (int)sizeof(line) - 1 && fh.read(line + n, 1) == 1 && line[n] != '\n') n++;
+		line[n] = 0;
+		sprintf(name, "key%d=%d", i % 50, i * 7);
+		if (strcmp(line, name)) {
+			check(false, "config read", i);
+			break;
+		}
+	}
+	fh.close();
+	tfs.remove("config");
+}
+
+// settings (40 keys, default index holds 48) in key-value store, one record
+// appended per setting and the one it replaces zeroed, reopen loads index in
+// one pass
+static void bench_kv(int count)
+{
+	Bench b("kv put"), l("kv load"), g("kv get");
+	char name[16], value[16], buf[16];
+	TFS_KV kv;
+	check(kv.open(tfs, "kvstore"), "kv open", 0);
+	for (int i = 0; i < count; i++) {
+		sprintf(name, "key%d", i % 40);
+		sprintf(value, "%d", i * 7);
+		b.begin();
+		check(kv.put(name, value, strlen(value)), "kv put", i);
+		b.end();
+	}
+	check(kv.remove("key0") && !kv.exists("key0"), "kv remove", 0);
+	b.report();
+	kv.close();
+
+	// record torn by interruption at the end is zeroed on load
+	TFS::File fh;
+	check(tfs.open("kvstore", fh), "kv torn", 0);
+	fh.write("\x6b\x04\x10\x00key", 7);
+	fh.close();
+	l.begin();
+	check(kv.open(tfs, "kvstore"), "kv reopen", 0);
+	l.end();
+	l.report();
+	check(kv.count() == 39, "kv count", kv.count());
+
+	for (int r = 0; r < 10; r++)
+		for (int k = 1; k < 40; k++) {
+			sprintf(name, "key%d", k);
+			sprintf(value, "%d", ((count - 1 - k) / 40 * 40 + k) * 7);
+			g.begin();
+			int n = kv.get(name, buf, sizeof(buf) - 1);
+			g.end();
+			buf[n < 0 ? 0 : n] = 0;
+			if (strcmp(buf, value)) {
+				check(false, "kv get", k);
+				break;
+			}
+		}
+	g.report();
+	check(kv.put("key0", "x", 1) && kv.get("key0", buf, 1) == 1 && buf[0] == 'x', "kv put after torn", 0);
+	check(TFS_KV::magic_size + kv.live_size() + kv.dead_size() == tfs.get_size("kvstore"), "kv size", kv.dead_size());
+	kv.close();
+	tfs.remove("kvstore");
+
+	// file of other format is left as it is
+	check(tfs.create("kvlegacy", fh) && fh.write("Hello=World\n", 12) == 12, "kv legacy", 0);
+	fh.close();
+	check(!kv.open(tfs, "kvlegacy") && tfs.get_size("kvlegacy") == 12 && tfs.open("kvlegacy", fh) && fh.read() == 'H', "kv foreign", 0);
+	fh.close();
+	tfs.remove("kvlegacy");
+}
+
+// record file where removed records are zeroed by File::erase, compaction
+// rewrites only live records and frees blocks of the rest
+static void bench_records(int records, int recsize)
+{
+	char rec[256];
+	TFS::File fh;
+	check(tfs.create("records", fh), "records create", 0);
+	for (int i = 0; i < records; i++) {
+		sprintf(rec, "%08d", i);
+		memset(rec + 8, 'r', recsize - 9);
+		rec[recsize - 1] = '\n';
+		fh.write(rec, recsize);
+	}
+	// every record but each fifth is removed
+	for (int i = 0; i < records; i++)
+		if (i % 5) fh.erase(i * recsize, recsize);
+	fh.close_fixed();
+	int before = tfs.freespace();
+	Bench b("records compact");
+	b.begin();
+	int dropped = tfs.compact("records");
+	b.end();
+	b.report();
+	check(dropped == (records - (records + 4) / 5) * recsize, "records dropped", dropped);
+	printf("%d of %d records kept, compaction freed %d blocks\n", (records + 4) / 5, records,
+		(tfs.freespace() - before) / TFS_BLOCK_SIZE);
+	check(tfs.open("records", fh), "records open", 0);
+	int next = 0;
+	while (fh.read(rec, recsize) == recsize) {
+		if (atoi(rec) != next) break;
+		next += 5;
+	}
+	fh.close();
+	check(next >= records, "records read", next);
+	check(tfs.compact("records") == 0, "records compact again", 0);
+	tfs.remove("records");
+}
+
+static bool check_settings(int gen, int size)
+{
+	char buf[512];
+	TFS::File fh;
+	if (!tfs.open("settings", fh) || fh.read(buf, sizeof(buf)) != size) return false;
+	for (int i = 0; i < size; i++)
+		if (buf[i] != (char)('A' + (gen + i) % 26)) return false;
+	return true;
+}
+
+static bool write_settings(TFS::File &fh, int gen, int size)
+{
+	char buf[512];
+	for (int i = 0; i < size; i++) buf[i] = 'A' + (gen + i) % 26;
+	return fh.write(buf, size) == size;
+}
+
+// large file removed and its blocks erased in idle time, with bulk erase
+// aligned groups of them are erased at once
+static void bench_big_remove(int size)
+{
+	char buf[4096];
+	TFS::File fh;
+	while (tfs.erase_idle(10)) ;
+	check(tfs.create("big", fh), "big create", 0);
+	memset(buf, 'b', sizeof(buf));
+	for (int pos = 0; pos < size; pos += sizeof(buf)) fh.write(buf, sizeof(buf));
+	fh.close_fixed();
+	tfs.remove("big");
+	Bench b("big erase");
+	short n;
+	do {
+		b.begin();
+		n = tfs.erase_idle(1);
+		b.end();
+	} while (n);
+	b.report();
+}
+
+// format of used flash, every block has to be erased
+static void bench_reformat()
+{
+	Bench b("format used");
+	b.begin();
+	tfs.format();
+	b.end();
+	b.report();
+	TFS::Dir d;
+	check(tfs.init(flash_sim_last_block_erased()) && !d.next(), "reformat", 0);
+}
+
+// settings file rewritten through shadow file and swapped in, old content
+// stays readable until replace, shadow left without replace is dropped by mount
+static void bench_replace(int count, int size)
+{
+	Bench b("replace");
+	TFS::File fh;
+	check(tfs.create("settings", fh) && write_settings(fh, 0, size), "settings create", 0);
+	fh.close();
+	for (int i = 1; i <= count; i++) {
+		b.begin();
+		bool ok = tfs.create_shadow("settings", fh) && write_settings(fh, i, size);
+		check(ok && check_settings(i - 1, size), "settings shadow", i);
+		check(tfs.replace(fh), "settings replace", i);
+		b.end();
+		check(check_settings(i, size), "settings read", i);
+		if (tfs.erase_needed()) tfs.erase_idle(1);
+	}
+	b.report();
+
+	int free = tfs.freespace();
+	check(tfs.create_shadow("settings", fh) && write_settings(fh, 0, size), "settings shadow", 0);
+	fh.close();
+	check(tfs.init(flash_sim_last_block_erased()), "mount", 0);
+	check(check_settings(count, size) && tfs.freespace() == free, "settings drop shadow", 0);
+	tfs.remove("settings");
+}
+
+// files of every last block size closed as fixed, size has to be programmed
+// over variable one in place (one program besides pending data)
+static void bench_fixed(int count)
+{
+	Bench b("close fixed");
+	char buf[512];
+	TFS::File fh;
+	for (int i = 0; i < count; i++) {
+		int size = (i * 1031) % (3 * TFS_BLOCK_SIZE) + 1;
+		check(tfs.create("fixed", fh), "fixed create", i);
+		for (int pos = 0; pos < size; pos += sizeof(buf)) {
+			int n = size - pos < (int)sizeof(buf) ? size - pos : sizeof(buf);
+			for (int j = 0; j < n; j++) buf[j] = content(i, pos + j);
+			fh.write(buf, n);
+		}
+		unsigned long long writes = flash_sim_get_stats().writes;
+		b.begin();
+		check(fh.close_fixed(), "fixed close", i);
+		b.end();
+		check(flash_sim_get_stats().writes - writes <= 2, "fixed in place", size % TFS_BLOCK_SIZE);
+		TFS::Dir dir;
+		char name[TFS_NAME_SIZE + 1];
+		bool fixed = false;
+		while (dir.next())
+			if (dir.get_name(name) && !strcmp(name, "fixed")) fixed = dir.isfixed();
+		check(fixed && tfs.get_size("fixed") == size, "fixed size", size);
+		tfs.remove("fixed");
+		if (tfs.erase_needed()) tfs.erase_idle(1);
+	}
+	b.report();
+}
+
+// small config files packed in shared blocks: write, read back, rewrite,
+// remove half and compact, reports number of blocks they occupy
+static void bench_packed(int count)
+{
+	char name[TFS_NAME_SIZE + 1], buf[256];
+	int sizes[MAX_FILES];
+	int free = tfs.freespace();
+	Bench b("packed write");
+	for (int i = 0; i < count; i++) {
+		sprintf(name, "p%03d", i);
+		sizes[i] = 20 + rnd(180);
+		for (int j = 0; j < sizes[i]; j++) buf[j] = (char)(i + j);
+		b.begin();
+		check(tfs.write_packed(name, buf, sizes[i]), "packed write", i);
+		b.end();
+	}
+	b.report();
+	int used = (free - tfs.freespace()) / TFS_BLOCK_SIZE;
+
+	Bench r("packed read");
+	for (int i = 0; i < count; i++) {
+		TFS::File fh;
+		sprintf(name, "p%03d", i);
+		r.begin();
+		bool ok = tfs.open(name, fh) && fh.read(buf, sizeof(buf)) == sizes[i];
+		r.end();
+		for (int j = 0; ok && j < sizes[i]; j++) ok = buf[j] == (char)(i + j);
+		check(ok && tfs.get_size(name) == sizes[i], "packed read", i);
+	}
+	r.report();
+
+	for (int i = 0; i < count; i += 2) {
+		sprintf(name, "p%03d", i);
+		tfs.remove(name);
+	}
+	Bench c("packed compact");
+	c.begin();
+	short freed = tfs.compact_packed();
+	c.end();
+	c.report();
+	for (int i = 1; i < count; i += 2) {
+		TFS::File fh;
+		sprintf(name, "p%03d", i);
+		bool ok = tfs.open(name, fh) && fh.read(buf, sizeof(buf)) == sizes[i];
+		for (int j = 0; ok && j < sizes[i]; j++) ok = buf[j] == (char)(i + j);
+		check(ok, "packed compact read", i);
+		fh.close();
+		tfs.remove(name);
+	}
+	// all pack blocks are freed, directory could have grown by a block
+	check(free - tfs.freespace() <= TFS_BLOCK_SIZE, "packed free", (free - tfs.freespace()) / TFS_BLOCK_SIZE);
+	printf("%d packed files used %d blocks, compaction freed %d\n", count, used, freed);
+}
+
+// files of second instance are appended and remounted next to main one,
+// which has to stay unchanged
+static void bench_partition(int count)
+{
+	char name[PART::name_size + 1], buf[64];
+	int files = 0, free = tfs.freespace();
+	TFS::Dir d;
+	while (d.next()) files++;
+
+	Bench f("part format");
+	f.begin();
+	part.format();
+	f.end();
+	f.report();
+
+	Bench b("part append");
+	PART::File fh;
+	for (int i = 0; i < count; i++) {
+		sprintf(name, "c%d", i % 8);
+		for (int j = 0; j < (int)sizeof(buf); j++) buf[j] = (char)((i + j) % 251);
+		b.begin();
+		check(part.open(name, fh, true) && fh.write(buf, sizeof(buf)) == sizeof(buf), "part append", i);
+		fh.close();
+		b.end();
+		if (part.erase_needed()) part.erase_idle(1);
+	}
+	b.report();
+
+	check(part.init(), "part mount", 0);
+	unsigned long long writes = flash_sim_get_stats().writes;
+	check(!other.init() && flash_sim_get_stats().writes == writes, "part other mount", 0);
+	check(part.detect() == PART::page_size && other.detect() == PART::page_size, "part detect", 0);
+	int n = 0;
+	PART::Dir pd(part);
+	while (pd.next()) {
+		check(pd.get_name(name), "part name", n);
+		int id = atoi(name + 1);
+		check(pd.get_size() == (count - id + 7) / 8 * (int)sizeof(buf), "part size", id);
+		n++;
+	}
+	check(n == 8, "part files", n);
+	check(part.open("c3", fh), "part open", 3);
+	for (int i = 3; i < count; i += 8) {
+		bool ok = fh.read(buf, sizeof(buf)) == sizeof(buf);
+		for (int j = 0; ok && j < (int)sizeof(buf); j++) ok = buf[j] == (char)((i + j) % 251);
+		check(ok, "part read", i);
+	}
+	fh.close();
+
+	TFS::Dir d2;
+	while (d2.next()) files--;
+	check(!files && tfs.freespace() == free && !tfs.exists("c3"), "part separate", files);
+	printf("partition %d blocks at %d KB: %d files, %d bytes free\n", PART::num_blocks, part_config::flash_offs / 1024, n, part.freespace());
+}
+
+#ifdef TFS_USE_STATS
+// counters of whole run and latency percentiles estimated from histograms
+static void print_stats()
+{
+	TFS::stats_t st;
+	tfs.stats(st);
+	printf("stats: %u reads (%u bytes), %u writes (%u bytes), %u erases (%u inline), %u chain steps, %u dir compactions\n",
+		st.reads, st.read_bytes, st.writes, st.write_bytes, st.erases, st.inline_erases, st.chain_steps, st.dir_defrags);
+#ifdef TFS_USE_STATS_CLOCK
+	static const char *ops[TFS_OPS] = { "open", "create", "remove", "read", "write", "seek", "close", "step" };
+	printf("%-8s %8s %10s %10s %10s\n", "op", "count", "p50 <us", "p99 <us", "max <us");
+	for (int op = 0; op < TFS_OPS; op++) {
+		unsigned int n = 0, sum = 0, p50 = 0, p99 = 0, max = 0;
+		for (int b = 0; b < TFS_HIST_BUCKETS; b++) n += st.hist[op][b];
+		for (int b = 0; b < TFS_HIST_BUCKETS; b++) {
+			if (!st.hist[op][b]) continue;
+			sum += st.hist[op][b];
+			if (!p50 && sum * 2 >= n) p50 = 1u << b;
+			if (!p99 && sum * 100 >= n * 99) p99 = 1u << b;
+			max = 1u << b;
+		}
+		printf("%-8s %8u %10u %10u %10u\n", ops[op], n, p50, p99, max);
+	}
+#endif
+}
+#endif
+
+static void usage()
+{
+	fprintf(stderr, "usage: tfs_bench [-i image] [-s seed] [-n files] [-r cycles] [-l records]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *image = 0;
+	int cycles = 1000, records = 20000;
+
+	for (int i = 1; i < argc; i++) {
+		if (i + 1 >= argc) usage();
+		if (!strcmp(argv[i], "-i")) image = argv[++i];
+		else if (!strcmp(argv[i], "-s")) _seed = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-n")) _nfiles = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-r")) cycles = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-l")) records = atoi(argv[++i]);
+		else usage();
+	}
+	if (_nfiles < 1 || _nfiles > MAX_FILES) usage();
+
+	if (!flash_sim_open(TFS_FLASH_OFFS + TFS_NUM_BLOCKS * TFS_PAGE_SIZE, image)) {
+		fprintf(stderr, "can't allocate flash\n");
+		return 1;
+	}
+
+	printf("TFS benchmark: %d blocks of %d bytes, %d files, seed %u\n", TFS_NUM_BLOCKS, TFS_PAGE_SIZE, _nfiles, _seed);
+	Bench::header();
+	bench_format();
+	bench_create();
+	bench_mount("mount", 3);
+	bench_open(cycles);
+	bench_read(cycles, 512);
+	bench_churn(cycles);
+	bench_read(cycles, 512);
+	bench_dir_churn(cycles);
+	bench_stream(256 * 1024, 4, 1024);
+	bench_log(records, 64, false);
+	bench_log(records, 64, true);
+	bench_worker(records / 10, 1024);
+	bench_ring(records, 64, 8);
+	bench_big_remove(512 * 1024);
+	bench_fixed(cycles / 4);
+	bench_replace(cycles, 300);
+	bench_config(cycles);
+	bench_kv(cycles);
+	bench_records(2000, 64);
+	bench_packed(_nfiles);
+	bench_partition(cycles / 4);
+	bench_mount("mount", 3);
+	bench_sync();
+	bench_mount("mount synced", 3);
+	bench_verify();
+	// checkpoint is invalidated by write, next mount does full check
+	check(write_file(0, 100), "rewrite", 0);
+	bench_mount("mount", 1);
+	bench_verify();
+	// image keeps files
+	if (!image) bench_reformat();
+
+	const flash_sim_stats &s = flash_sim_get_stats();
+	unsigned int hits, misses;
+	tfs.cache_stats(hits, misses);
+	printf("read cache (%d lines): %u hits, %u misses\n", TFS_CACHE_LINES, hits, misses);
+	unsigned int programs, saved;
+	tfs.write_stats(programs, saved);
+	printf("write cache: %u programs, %u writes merged\n", programs, saved);
+#ifdef TFS_USE_STATS
+	print_stats();
+#endif
+	printf("NOR violations: %llu, unaligned ops: %llu, busy ops: %llu, simulated time %.1f ms\n",
+		s.nor_violations, s.unaligned, s.busy, flash_sim_time() / 1e6);
+	flash_sim_close();
+	if (_errors) printf("%d errors\n", _errors);
+	return _errors ? 1 : 0;
+}
@@ -0,0 +1,269 @@
+// Twilight File System - multithreaded stress test on host flash simulator
+//
+// built with TFS_USE_LOCKS, implements lock functions with pthreads and
+// reads different files from several threads at once (each handle with own
+// buffer) while one thread keeps creating, appending and removing files,
+// reports read throughput (wall clock) for growing number of threads, with
+// stats checks that timing of parallel reads stays consistent
+//
+// Copyright(C) 2017. Nebojsa Sumrak <nsumrak@yahoo.com>
+//
+//   This program is free software; you can redistribute it and / or modify
+//	 it under the terms of the GNU General Public License as published by
+//	 the Free Software Foundation; either version 2 of the License, or
+//	 (at your option) any later version.
+//
+//	 This program is distributed in the hope that it will be useful,
+//	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+//	 GNU General Public License for more details.
+//
+//	 You should have received a copy of the GNU General Public License along
+//	 with this program; if not, write to the Free Software Foundation, Inc.,
+//	 51 Franklin Street, Fifth Floor, Boston, MA 02110 - 1301 USA.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "flash_sim.h"
+#include "../tfs.h"
+
+#ifndef TFS_USE_LOCKS
+#error "tfs_stress has to be built with TFS_USE_LOCKS"
+#endif
+
+TFS tfs;
+
+//
+// reader/writer lock, recursive for the thread holding exclusive lock, new
+// readers wait while writer waits, so metadata writer isn't starved
+//
+
+static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _cond = PTHREAD_COND_INITIALIZER;
+static pthread_t _owner;
+static int _depth, _readers, _writers;
+// locks taken by reader threads, reads of buffered files have to be shared
+static __thread bool _reader;
+static unsigned long long _reader_shared, _reader_exclusive;
+
+static bool owned()
+{
+	return _depth && pthread_equal(_owner, pthread_self());
+}
+
+void tfs_lock()
+{
+	if (_reader) __atomic_fetch_add(&_reader_exclusive, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&_mutex);
+	if (owned()) _depth++;
+	else {
+		_writers++;
+		while (_depth || _readers) pthread_cond_wait(&_cond, &_mutex);
+		_writers--;
+		_owner = pthread_self();
+		_depth = 1;
+	}
+	pthread_mutex_unlock(&_mutex);
+}
+
+void tfs_unlock()
+{
+	pthread_mutex_lock(&_mutex);
+	if (!--_depth) pthread_cond_broadcast(&_cond);
+	pthread_mutex_unlock(&_mutex);
+}
+
+void tfs_lock_shared()
+{
+	if (_reader) __atomic_fetch_add(&_reader_shared, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&_mutex);
+	if (owned()) _depth++;
+	else {
+		while (_depth || _writers) pthread_cond_wait(&_cond, &_mutex);
+		_readers++;
+	}
+	pthread_mutex_unlock(&_mutex);
+}
+
+void tfs_unlock_shared()
+{
+	pthread_mutex_lock(&_mutex);
+	if (owned()) _depth--;
+	else if (!--_readers) pthread_cond_broadcast(&_cond);
+	pthread_mutex_unlock(&_mutex);
+}
+
+//
+// workload
+//
+
+#define MAX_THREADS	8
+#define FILE_SIZE	(192 * 1024)
+
+static bool _stop;
+static int _errors;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void check(bool ok, const char *what, int arg)
+{
+	if (ok) return;
+	__atomic_fetch_add(&_errors, 1, __ATOMIC_RELAXED);
+	if (_errors < 10) printf("error: %s %d failed\n", what, arg);
+}
+
+static char content(int id, int pos)
+{
+	return (char)((id * 31 + pos) % 251);
+}
+
+struct reader_t {
+	pthread_t thread;
+	int id;
+	unsigned long long bytes;
+};
+
+// read own file over and over until stopped
+static void *reader(void *arg)
+{
+	reader_t *r = (reader_t *)arg;
+	_reader = true;
+	char align4 fbuf[2048];
+	char buf[512], name[TFS_NAME_SIZE + 1];
+	sprintf(name, "s%d", r->id);
+	TFS::File fh;
+	fh.set_buffer(fbuf, sizeof(fbuf));
+	while (!__atomic_load_n(&_stop, __ATOMIC_RELAXED)) {
+		check(tfs.open(name, fh), "open", r->id);
+		int pos = 0, n;
+		while ((n = fh.read(buf, sizeof(buf))) > 0) {
+			for (int i = 0; i < n; i++)
+				if (buf[i] != content(r->id, pos + i)) {
+					check(false, "read", pos + i);
+					break;
+				}
+			pos += n;
+		}
+		check(pos == FILE_SIZE, "size", pos);
+		fh.close();
+		r->bytes += pos;
+	}
+	fh.set_buffer(0, 0);
+	return 0;
+}
+
+// metadata changes serialized with reads
+static void *writer(void *arg)
+{
+	int *cycles = (int *)arg;
+	char align4 fbuf[512];
+	char buf[100];
+	memset(buf, 'w', sizeof(buf));
+	TFS::File fh;
+	fh.set_buffer(fbuf, sizeof(fbuf));
+	while (!__atomic_load_n(&_stop, __ATOMIC_RELAXED)) {
+		check(tfs.create("churn", fh), "create", *cycles);
+		for (int i = 0; i < 10; i++) check(fh.write(buf, sizeof(buf)) == sizeof(buf), "write", *cycles);
+		fh.close();
+		check(tfs.get_size("churn") == 10 * sizeof(buf), "churn size", *cycles);
+		tfs.remove("churn");
+		if (tfs.erase_needed()) tfs.erase_idle(1);
+		(*cycles)++;
+		usleep(100);
+	}
+	fh.set_buffer(0, 0);
+	return 0;
+}
+
+static double run(int threads, double seconds)
+{
+	reader_t r[MAX_THREADS];
+	pthread_t w;
+	int cycles = 0;
+	__atomic_store_n(&_stop, false, __ATOMIC_RELAXED);
+	for (int i = 0; i < threads; i++) {
+		r[i].id = i;
+		r[i].bytes = 0;
+		pthread_create(&r[i].thread, 0, reader, &r[i]);
+	}
+	pthread_create(&w, 0, writer, &cycles);
+	double start = now();
+	usleep((useconds_t)(seconds * 1e6));
+	__atomic_store_n(&_stop, true, __ATOMIC_RELAXED);
+	unsigned long long bytes = 0;
+	for (int i = 0; i < threads; i++) {
+		pthread_join(r[i].thread, 0);
+		bytes += r[i].bytes;
+	}
+	pthread_join(w, 0);
+	double t = now() - start;
+	double mbs = bytes / t / (1024 * 1024);
+	printf("%7d %10.1f %8.2f %10.1f %8d\n", threads, bytes / (1024.0 * 1024), t, mbs, cycles);
+	return mbs;
+}
+
+int main(int argc, char **argv)
+{
+	double seconds = argc > 1 ? atof(argv[1]) : 1;
+	if (!flash_sim_open(TFS_FLASH_OFFS + TFS_NUM_BLOCKS * TFS_PAGE_SIZE)) {
+		fprintf(stderr, "can't allocate flash\n");
+		return 1;
+	}
+	tfs.format();
+	char buf[4096], name[TFS_NAME_SIZE + 1];
+	for (int id = 0; id < MAX_THREADS; id++) {
+		TFS::File fh;
+		sprintf(name, "s%d", id);
+		check(tfs.create(name, fh), "create", id);
+		for (int pos = 0; pos < FILE_SIZE; pos += sizeof(buf)) {
+			for (int i = 0; i < (int)sizeof(buf); i++) buf[i] = content(id, pos + i);
+			fh.write(buf, sizeof(buf));
+		}
+		fh.close_fixed();
+	}
+
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	printf("TFS stress: %ld cores, %d KB per reader, one metadata writer\n", cores, FILE_SIZE / 1024);
+	// on one core more readers only take CPU time from the writer
+	if (cores < 2) printf("single core, speedup doesn't show parallel reads\n");
+	printf("%7s %10s %8s %10s %8s\n", "readers", "MB read", "seconds", "MB/s", "changes");
+	double base = 0;
+	for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+		double mbs = run(threads, seconds);
+		if (threads == 1) base = mbs;
+		else printf("%7s speedup %.2fx\n", "", base > 0 ? mbs / base : 0);
+	}
+
+	// open and close are exclusive, every read of the file should be shared
+	printf("reader locks: %llu shared, %llu exclusive\n", _reader_shared, _reader_exclusive);
+	check(_reader_shared > 20 * _reader_exclusive, "shared reads", (int)_reader_exclusive);
+
+#ifdef TFS_USE_STATS_CLOCK
+	// parallel timed reads must leave nesting at zero, so next read is timed
+	TFS::stats_t st;
+	TFS::File fh;
+	tfs.stats(st, true);
+	check(tfs.open("s0", fh) && fh.read(buf, sizeof(buf)) == sizeof(buf), "timed read", 0);
+	fh.close();
+	tfs.stats(st);
+	unsigned int timed = 0;
+	for (int n = 0; n < TFS_HIST_BUCKETS; n++) timed += st.hist[TFS_OP_READ][n];
+	printf("timed reads after parallel ones: %u\n", timed);
+	check(timed == 1, "timed reads", timed);
+#endif
+
+	const flash_sim_stats &s = flash_sim_get_stats();
+	printf("NOR violations: %llu, unaligned ops: %llu\n", s.nor_violations, s.unaligned);
+	flash_sim_close();
+	if (_errors) printf("%d errors\n", _errors);
+	return _errors || s.nor_violations ? 1 : 0;
+}
@@ -1,7 +1,8 @@
 // Twilight File System
 //
 // specificaly designed for NOR flash, 4KB erase block, 4 byte read/write granularity
-// maximum number of blocks is 16382 (~64MB flash/file size for 4KB erase block)
+// maximum number of blocks is 16382 (~64MB flash/file size for 4KB erase block,
+// block of several sectors allows up to ~256MB, including flash offset)
 // write always appends data (and there is erase function to erase - fill with 0 - part of the file)
 // file can be closed with fixed size
 // or can be variable but in that case trailing bytes must not be 0xff
@@ -35,13 +36,26 @@
 #endif
 
 #define TFS_MAGIC		0xBabaDeda
+#define TFS_CP_MAGIC	0xC0deBaba
 
-#define TFS_PAGE_SIZE	4096
+// flash erase sector
+#define TFS_SECTOR_SIZE	4096
+
+// sectors in block (allocation unit), with more of them larger flash can be
+// used and large files have fewer chain steps, but every file takes at least
+// one block, block can be up to 16KB, format differs for each block size
+#ifndef TFS_BLOCK_SECTORS
+#define TFS_BLOCK_SECTORS	1
+#endif
+
+#define TFS_PAGE_SIZE	(TFS_SECTOR_SIZE*TFS_BLOCK_SECTORS)
 // 2bytes control per block
 #define TFS_BLOCK_SIZE	(TFS_PAGE_SIZE-2)
 
 // 3M flash size -> num_blocks = 768 - 4 sectors sys parameter
+#ifndef TFS_NUM_BLOCKS
 #define TFS_NUM_BLOCKS	764
+#endif
 
 #if ((TFS_NUM_BLOCKS<0) || (TFS_NUM_BLOCKS>0x3ffe))
 #error "TFS support up to 0x3ffe blocks"
@@ -50,31 +64,192 @@
 #define TFS_CACHE_SIZE	256
 #define TFS_LIMIT_WRITE_CACHE
 
+// uncomment next line to keep appends in write cache aligned to flash program
+// page (TFS_CACHE_SIZE) until the page is full, file is closed or sync() is
+// called, so small writes are merged into one program, reads see pending data
+// without programming it, data appended since close or sync may be lost on
+// power failure
+//#define TFS_USE_WRITE_BACK
+
+// number of read cache lines of TFS_CACHE_SIZE, write cache is separate
+#ifndef TFS_CACHE_LINES
+#define TFS_CACHE_LINES	2
+#endif
+
 // comment next line to lower memory usage with performance penalty
 #define TFS_USE_BLOCK_CACHE
 
-#if (TFS_PAGE_SIZE % TFS_CACHE_SIZE != 0)
-#error "cache size should be division of page"
+// comment next line to find free/dirty blocks by scanning block descriptors
+// instead of bitmaps (2 bits per block)
+#define TFS_USE_FREE_MAP
+
+#define TFS_CP_DESC		0xbfff
+
+// checkpoint blocks hold no file data, so directory magic differs with it
+#ifdef TFS_USE_CHECKPOINT
+#define TFS_CP_VARIANT	0x100
+#else
+#define TFS_CP_VARIANT	0
+#endif
+
+// when less erased blocks are left erase_needed() reports that write may
+// have to erase block inline, call erase_idle() to prepare them in advance
+#ifndef TFS_ERASE_RESERVE
+#define TFS_ERASE_RESERVE	4
+#endif
+
+// step() compacts directory when it has at least this many deleted entries,
+// create only grows full directory by a block and compacts it if none is left
+#ifndef TFS_DIR_DEFRAG
+#define TFS_DIR_DEFRAG	128
+#endif
+
+// uncomment next line to keep hashed directory index in RAM (4 bytes per entry)
+// so open, exists and remove don't scan directory file
+//#define TFS_USE_DIR_INDEX
+
+// number of index entries (power of 2), when more than 3/4 is used lookups
+// fall back to directory scan
+#ifndef TFS_DIR_INDEX_SIZE
+#define TFS_DIR_INDEX_SIZE	256
+#endif
+
+#if (TFS_DIR_INDEX_SIZE & (TFS_DIR_INDEX_SIZE - 1))
+#error "TFS directory index size must be power of 2"
+#endif
+
+// uncomment next line to keep checkpoint of block table in last two blocks,
+// written by sync(), so init() after clean shutdown doesn't read descriptor of
+// every block and walk every file chain
+//#define TFS_USE_CHECKPOINT
+
+// uncomment next line if flash can erase sector in background, erase is then
+// only started and TFS waits for it (calling do_yield) just before next flash
+// access, so step() returns without waiting
+//#define TFS_USE_ASYNC_ERASE
+
+// uncomment next line if flash has 32KB/64KB block erase or chip erase, format
+// and background erase then erase aligned groups of blocks at once (format
+// only groups which aren't blank, background erase groups where at least half
+// of blocks are dirty and the rest erased, as after removal of large file)
+//#define TFS_USE_BULK_ERASE
+
+// size of flash chip, if file system starts at 0 and takes all of it format
+// uses chip erase (with TFS_USE_BULK_ERASE)
+#ifndef TFS_CHIP_SIZE
+#define TFS_CHIP_SIZE	0
+#endif
+
+// uncomment next line if flash can read in background (DMA), read-ahead of
+// files with own buffer (File::set_buffer) is then only started and runs
+// while previous window is consumed
+//#define TFS_USE_ASYNC_READ
+
+// uncomment next line if flash is mapped to address space (ESP8266, STM32
+// and other XIP parts), File::map() then returns pointer to file data in
+// place instead of copying it, flash_map function has to be implemented
+//#define TFS_USE_FLASH_MAP
+
+// uncomment next line to use TFS from several threads, lock functions have to
+// be implemented, reads of files with own buffer (File::set_buffer) are done in
+// parallel, everything else is serialized
+//#define TFS_USE_LOCKS
+
+// uncomment next line to count flash operations, cache use, inline erases,
+// chain steps and directory compactions (tfs.stats()), with TFS_USE_STATS_CLOCK
+// latency of public operations is also kept in histograms, clock function
+// has to be implemented
+//#define TFS_USE_STATS
+//#define TFS_USE_STATS_CLOCK
+
+#if defined(TFS_USE_STATS_CLOCK) && !defined(TFS_USE_STATS)
+#define TFS_USE_STATS
+#endif
+
+// timed operations, histogram bucket n counts latencies under 2^n us
+#define TFS_OP_OPEN		0
+#define TFS_OP_CREATE	1
+#define TFS_OP_REMOVE	2
+#define TFS_OP_READ		3
+#define TFS_OP_WRITE	4
+#define TFS_OP_SEEK		5
+#define TFS_OP_CLOSE	6
+#define TFS_OP_STEP		7
+#define TFS_OPS			8
+#define TFS_HIST_BUCKETS	20
+
+#ifdef TFS_USE_STATS
+#define TFS_STAT(s)		s
+#else
+#define TFS_STAT(s)
+#endif
+
+// counters are also updated by reads which hold only shared lock
+#ifdef TFS_USE_LOCKS
+#define TFS_ADD(v, n)	__atomic_add_fetch(&(v), n, __ATOMIC_RELAXED)
+#else
+#define TFS_ADD(v, n)	((v) += (n))
+#endif
+
+#ifdef TFS_USE_STATS_CLOCK
+#define TFS_TIME(op)	op_timer_t _timer(owner(), op)
+#else
+#define TFS_TIME(op)
+#endif
+
+#ifdef TFS_USE_LOCKS
+#define TFS_LOCK			lock_t _lock
+#define TFS_LOCK_SHARED(c)	lock_t _lock(true); if (!(c)) _lock.exclusive()
+#else
+#define TFS_LOCK
+#define TFS_LOCK_SHARED(c)
+#endif
+
+#if (TFS_PAGE_SIZE % TFS_CACHE_SIZE != 0 || (TFS_CACHE_SIZE & (TFS_CACHE_SIZE - 1)))
+#error "cache size should be power of 2 and division of page"
 #endif
 
 // First 1MB of flash is used for firmware
 #define TFS_FLASH_OFFS	(1024*1024)
 
-#define TFS_FLASH_SEC_OFFS (TFS_FLASH_OFFS/TFS_PAGE_SIZE)
-#define flash_addr(a) (TFS_FLASH_OFFS+(a))
-#define flash_sector(a) (TFS_FLASH_SEC_OFFS+(a))
-
 #define TFS_BLF_ERASED	3
 #define TFS_BLF_SYSTEM	2
 #define TFS_BLF_NORMAL	1
 #define TFS_BLF_DIRTY	0
 
 // over the maximum file/flash size
-#define TFS_SEEK_END	0x4000000
+#define TFS_SEEK_END	0x40000000
+
+// variable size file keeps upper bound of data in its first block inside size
+// field of directory entry, in bits above those fixed size needs (12-14 for
+// 4KB block, none left for 16KB), see hint_shift
+// bits 0-10 of variable file size are maximum number of blocks of ring file
+#define TFS_RING_NONE	0x7ff
+
+// flags in first block of directory entry which is not yet in effect, pending
+// entry replaces older entry with the same name when that one is cleared,
+// shadow flag is cleared when commit starts, until then entry can be dropped
+#define TFS_PENDING		0x4000
+#define TFS_SHADOW		0x8000
+
+// size field of packed file is offset of its slot in shared block (bits 0-13)
+// with this bit set, slot starts with size and word cleared when file is removed
+#define TFS_PACKED		0x4000
+
+// maximum size of packed file
+#ifndef TFS_PACK_MAX
+#define TFS_PACK_MAX	1024
+#endif
 
 #define align4	__attribute__((aligned(4)))
 #define minusone	((char)-1)
 
+#ifdef TFS_USE_CHECKPOINT
+#ifndef TFS_USE_BLOCK_CACHE
+#error "TFS checkpoint needs block cache"
+#endif
+#endif
+
 extern int flash_read(unsigned int src_addr, unsigned int * des_addr, unsigned int size);
 extern int flash_write(unsigned int des_addr, unsigned int *src_addr, unsigned int size);
 extern int flash_erase_sector(unsigned short sec);
@@ -82,13 +257,172 @@ extern int flash_erase_sector(unsigned short sec);
 extern void do_yield();
 // implement and write value to eprom if you want wear leveling enabled
 extern void set_last_block_erased(short lbe);
+#ifdef TFS_USE_ASYNC_ERASE
+// start sector erase and return, poll until it is done
+extern int flash_erase_start(unsigned short sec);
+extern bool flash_erase_done();
+#endif
+#ifdef TFS_USE_BULK_ERASE
+// erase size bytes (32KB or 64KB aligned to it, 0 for whole chip) starting
+// with sector, if wait is false only start it and poll with flash_erase_done(),
+// return non-zero if size is not supported (sectors are erased then)
+extern int flash_erase_bulk(unsigned short sec, unsigned int size, bool wait);
+#endif
+#ifdef TFS_USE_ASYNC_READ
+// start read to buffer and return, poll until it is done
+extern int flash_read_start(unsigned int src_addr, unsigned int *des_addr, unsigned int size);
+extern bool flash_read_done();
+#endif
+#ifdef TFS_USE_FLASH_MAP
+// return pointer to size bytes of flash starting with addr, or 0 if the whole
+// range isn't mapped (File::map() fails then and read() has to be used)
+extern const void *flash_map(unsigned int addr, unsigned int size);
+#endif
+#ifdef TFS_USE_STATS_CLOCK
+// implement free running microsecond clock
+extern unsigned int tfs_clock();
+#endif
+#ifdef TFS_USE_LOCKS
+// implement reader/writer lock, it has to be recursive for the thread holding
+// exclusive lock, so both shared and exclusive lock taken again by it succeed
+extern void tfs_lock();
+extern void tfs_unlock();
+extern void tfs_lock_shared();
+extern void tfs_unlock_shared();
+#endif
 
-class TFS;
-extern TFS tfs;
+// geometry and flash functions of file system instance, default one uses
+// defines above and extern functions, other instance (another flash
+// region or chip) is TFS_T<config> where config overrides some of them
+struct tfs_config
+{
+	enum {
+		sector_size = TFS_SECTOR_SIZE, // erase unit
+		page_size = TFS_PAGE_SIZE, // block, whole sectors
+		num_blocks = TFS_NUM_BLOCKS,
+		name_size = TFS_NAME_SIZE,
+		cache_size = TFS_CACHE_SIZE,
+		cache_lines = TFS_CACHE_LINES,
+		flash_offs = TFS_FLASH_OFFS,
+		chip_size = TFS_CHIP_SIZE
+	};
+
+	static int flash_read(unsigned int src_addr, unsigned int *des_addr, unsigned int size) { return ::flash_read(src_addr, des_addr, size); }
+	static int flash_write(unsigned int des_addr, unsigned int *src_addr, unsigned int size) { return ::flash_write(des_addr, src_addr, size); }
+	static int flash_erase_sector(unsigned short sec) { return ::flash_erase_sector(sec); }
+	static void do_yield() { ::do_yield(); }
+	static void set_last_block_erased(short lbe) { ::set_last_block_erased(lbe); }
+#ifdef TFS_USE_ASYNC_ERASE
+	static int flash_erase_start(unsigned short sec) { return ::flash_erase_start(sec); }
+	static bool flash_erase_done() { return ::flash_erase_done(); }
+#endif
+#ifdef TFS_USE_BULK_ERASE
+	static int flash_erase_bulk(unsigned short sec, unsigned int size, bool wait) { return ::flash_erase_bulk(sec, size, wait); }
+#endif
+#ifdef TFS_USE_ASYNC_READ
+	static int flash_read_start(unsigned int src_addr, unsigned int *des_addr, unsigned int size) { return ::flash_read_start(src_addr, des_addr, size); }
+	static bool flash_read_done() { return ::flash_read_done(); }
+#endif
+#ifdef TFS_USE_FLASH_MAP
+	static const void *flash_map(unsigned int addr, unsigned int size) { return ::flash_map(addr, size); }
+#endif
+#ifdef TFS_USE_STATS_CLOCK
+	static unsigned int tfs_clock() { return ::tfs_clock(); }
+#endif
+};
 
-class TFS
+template <class C> class TFS_T
 {
+public:
+	// geometry of this instance
+	enum {
+		page_size = C::page_size,
+		block_size = C::page_size - 2, // 2 bytes control per block
+		sector_size = C::sector_size,
+		block_sectors = C::page_size / C::sector_size,
+		num_blocks = C::num_blocks,
+		name_size = C::name_size,
+		cache_size = C::cache_size,
+		cache_lines = C::cache_lines,
+		map_words = (C::num_blocks + 31) / 32,
+		// checkpoint slots are the last two blocks, block table is stored after header
+		cp_slot = C::num_blocks - 2,
+		cp_table = ((C::num_blocks + 1) & ~1) * 2,
+		// end hint bits: n of them cleared keep bound at n/hint_bits of block,
+		// none or all cleared mean there is no bound
+		hint_shift = (block_size < 2048 ? 11 : block_size < 4096 ? 12 : block_size < 8192 ? 13 : 14),
+		hint_bits = 15 - hint_shift,
+		hint_mask = ((1 << hint_bits) - 1) << hint_shift,
+		hint_unit = (C::page_size / hint_bits) & ~3
+	};
+
+	// directory magic differs for each block size and with checkpoint, so
+	// init() mounts only file system of own format
+	static const unsigned int dir_magic = TFS_MAGIC + ((C::page_size ^ 4096) >> 8) + TFS_CP_VARIANT;
+
+	// block offsets and sizes are shorts, packed slot offset is 14 bits
+	static_assert(page_size <= 16384 && !(page_size % sector_size), "TFS block up to 16KB of whole sectors");
+	static_assert(!(page_size % cache_size) && !(cache_size & (cache_size - 1)), "cache size should be power of 2 and division of page");
+	static_assert(num_blocks > 2 && num_blocks <= 0x3ffe, "TFS support up to 0x3ffe blocks");
+	// sector numbers passed to flash functions are 16 bit
+	static_assert(C::flash_offs / sector_size + (unsigned int)num_blocks * block_sectors <= 0xffff, "TFS flash area ends past sector 0xffff");
+	static_assert(name_size >= 4 && !(name_size & 3), "TFS file name size must be dividable by 4");
+#ifdef TFS_USE_CHECKPOINT
+	static_assert(cp_table + 20 <= block_size, "TFS block table doesn't fit in checkpoint block");
+#endif
+
 protected:
+#ifdef TFS_USE_LOCKS
+	// lock for scope of public function, shared one can be made exclusive
+	struct lock_t {
+		bool _shared;
+
+		lock_t(bool shared = false) : _shared(shared)
+		{
+			if (shared) tfs_lock_shared();
+			else tfs_lock();
+		}
+
+		void exclusive()
+		{
+			if (!_shared) return;
+			tfs_unlock_shared();
+			tfs_lock();
+			_shared = false;
+		}
+
+		~lock_t()
+		{
+			if (_shared) tfs_unlock_shared();
+			else tfs_unlock();
+		}
+	};
+#endif
+
+#ifdef TFS_USE_STATS_CLOCK
+	// latency of outermost public function is added to its histogram
+	// (file handle which is not open has no owner and isn't timed)
+	struct op_timer_t {
+		TFS_T *_fs;
+		short _op;
+		unsigned int _start;
+
+		op_timer_t(TFS_T *fs, short op) : _fs(fs)
+		{
+			if (!fs) return;
+			_op = (TFS_ADD(fs->_op_depth, 1) > 1 ? -1 : op);
+			_start = C::tfs_clock();
+		}
+
+		~op_timer_t()
+		{
+			if (!_fs) return;
+			TFS_ADD(_fs->_op_depth, -1);
+			if (_op >= 0) _fs->stats_time(_op, C::tfs_clock() - _start);
+		}
+	};
+#endif
+
 	struct block_t {
 		unsigned short _desc;
 
@@ -131,66 +465,446 @@ protected:
 	};
 
 #ifdef TFS_USE_BLOCK_CACHE
-	block_t _block_table[TFS_NUM_BLOCKS];
+	block_t align4 _block_table[(num_blocks + 1) & ~1];
+#endif
+#ifdef TFS_USE_FREE_MAP
+	// bit per block with erased or dirty flag
+	unsigned int _erased_map[map_words];
+	unsigned int _dirty_map[map_words];
 #endif
 	short _next_file;
 	short _last_block_erased;
 	short _free_blocks;
+	short _erased_blocks;
+	short _formatting; // next block to erase + 1 while format is in progress
+#ifdef TFS_USE_ASYNC_ERASE
+	short _erasing; // block being erased + 1, 0 if none
+	short _erase_sec; // sectors of it started
+	short _erase_run; // blocks erased at once by bulk erase
+#endif
+#ifdef TFS_USE_ASYNC_READ
+	bool _reading; // read-ahead in progress
+#endif
+#ifdef TFS_USE_CHECKPOINT
+	struct cp_header {
+		unsigned int magic, gen;
+		unsigned int valid; // cleared on first change after checkpoint
+		unsigned int sum;
+		unsigned short dir, nblocks;
+	};
+	unsigned int _cp_gen;
+	short _cp_slot;
+	bool _cp_valid;
+#endif
+
+	// read cache, cache_lines lines aligned to cache_size with LRU replacement
+	struct cache_line_t {
+		block_t block;
+		short offs;
+		unsigned short used;
+	};
+	cache_line_t _lines[cache_lines];
+	unsigned short _c_clock;
+	unsigned int _c_hits, _c_misses;
+	char align4 _cache[cache_lines][cache_size];
+
+	// write cache
+	block_t _w_block;
+	short _w_offs;
+	short _w_size;
+#ifdef TFS_USE_WRITE_BACK
+	short _w_lo, _w_hi; // written part of cached page
+	bool _w_merged; // pending data was merged to read cache line
+#endif
+	unsigned int _w_programs, _w_saved;
+	char align4 _wcache[cache_size];
+
+	void invalidate_cache()
+	{
+		for (int i = 0; i < cache_lines; i++) _lines[i].block.invalidate();
+	}
+
+	void invalidate_cache(block_t block)
+	{
+		for (int i = 0; i < cache_lines; i++)
+			if (_lines[i].block == block) _lines[i].block.invalidate();
+	}
+
+	void invalidate_line(block_t block, short offs)
+	{
+		for (int i = 0; i < cache_lines; i++)
+			if (_lines[i].block == block && _lines[i].offs == offs) _lines[i].block.invalidate();
+	}
+
+	// wait for erase or read started in background
+	void flash_wait()
+	{
+		#ifdef TFS_USE_ASYNC_ERASE
+			if (_erasing) erase_wait();
+		#endif
+		read_wait();
+	}
+
+	static unsigned int flash_addr(unsigned int a)
+	{
+		return C::flash_offs + a;
+	}
+
+	// first sector of block
+	static unsigned short flash_sector(unsigned short a)
+	{
+		return C::flash_offs / sector_size + a * block_sectors;
+	}
+
+	// flash access, operation started in background has to be finished first
+	void read_flash(unsigned int addr, void *buf, unsigned int size)
+	{
+		flash_wait();
+		C::flash_read(addr, (unsigned int *)buf, size);
+		TFS_STAT(TFS_ADD(_stats.reads, 1); TFS_ADD(_stats.read_bytes, size));
+	}
+
+	void write_flash(unsigned int addr, void *data, unsigned int size)
+	{
+		flash_wait();
+		C::flash_write(addr, (unsigned int *)data, size);
+		TFS_STAT(TFS_ADD(_stats.writes, 1); TFS_ADD(_stats.write_bytes, size));
+	}
+
+	// erase all sectors of block starting with sec
+	void erase_flash(unsigned short sec)
+	{
+		flash_wait();
+		for (int i = 0; i < block_sectors; i++) C::flash_erase_sector(sec + i);
+		TFS_STAT(TFS_ADD(_stats.erases, 1));
+	}
+
+	// erase block, with TFS_USE_ASYNC_ERASE it is only started (first sector
+	// of it, the rest are started as previous one is done)
+	void erase_start(block_t bl)
+	{
+		#ifdef TFS_USE_ASYNC_ERASE
+			flash_wait();
+			C::flash_erase_start(flash_sector(bl.no()));
+			_erasing = bl.no() + 1;
+			_erase_sec = 1;
+			_erase_run = 1;
+			TFS_STAT(TFS_ADD(_stats.erases, 1));
+		#else
+			erase_flash(flash_sector(bl.no()));
+			erase_complete(bl);
+		#endif
+	}
+
+	void erase_complete(block_t bl)
+	{
+		// format sets all maps at the end
+		if (_formatting) return;
+		invalidate_cache(bl);
+		map_block(bl.no(), 0xffff);
+		_erased_blocks++;
+		C::set_last_block_erased((_last_block_erased = bl.no()));
+	}
+
+#ifdef TFS_USE_ASYNC_ERASE
+	void erase_wait()
+	{
+		if (!_erasing) return;
+		while (!erase_poll()) C::do_yield();
+	}
+
+	// true when block is erased, next sector of it is started when previous
+	// one is done
+	bool erase_poll()
+	{
+		if (!C::flash_erase_done()) return false;
+		if (_erase_sec < block_sectors) {
+			C::flash_erase_start(flash_sector(_erasing - 1) + _erase_sec++);
+			return false;
+		}
+		block_t bl;
+		bl.set(_erasing - 1);
+		_erasing = 0;
+		#ifdef TFS_USE_BULK_ERASE
+			if (_erase_run > 1) {
+				erase_group_complete(bl.no(), _erase_run);
+				return true;
+			}
+		#endif
+		erase_complete(bl);
+		return true;
+	}
+#endif
+
+#ifdef TFS_USE_BULK_ERASE
+	// first block of group of size bytes aligned in flash which contains
+	// block b, -1 if group isn't inside file system
+	static short bulk_group(short b, unsigned int size)
+	{
+		short g = size / page_size;
+		unsigned int gs = size / sector_size;
+		if (g < 2 || size % page_size) return -1;
+		short s = b - (short)(flash_sector(b) % gs / block_sectors);
+		if (s < 0 || s + g > num_blocks || flash_sector(s) % gs) return -1;
+		return s;
+	}
+
+	// erase blocks with one bulk erase of size bytes (0 for chip), false if
+	// flash doesn't support it
+	bool erase_bulk(short first, short blocks, unsigned int size)
+	{
+		flash_wait();
+		#ifdef TFS_USE_ASYNC_ERASE
+			if (C::flash_erase_bulk(flash_sector(first), size, false)) return false;
+			_erasing = first + 1;
+			_erase_sec = block_sectors;
+			_erase_run = blocks;
+		#else
+			if (C::flash_erase_bulk(flash_sector(first), size, true)) return false;
+			erase_group_complete(first, blocks);
+		#endif
+		TFS_STAT(TFS_ADD(_stats.erases, 1));
+		return true;
+	}
+
+	// blocks which were erased before are not counted again, they could be
+	// taken by write meanwhile
+	void erase_group_complete(short first, short blocks)
+	{
+		block_t bl;
+		for (short i = first; i < first + blocks; i++) {
+			bl.set(i);
+			if (_formatting || get_next_block(bl).flag() == TFS_BLF_DIRTY) erase_complete(bl);
+		}
+	}
 
-	block_t _c_block;
-	short _c_offs;
-	short _c_size;
-	char align4 _cache[TFS_CACHE_SIZE];
+	// erase aligned group around dirty block b at once if at least half of its
+	// blocks are dirty and the rest erased
+	bool erase_group(short b)
+	{
+		for (unsigned int size = 65536; size >= 32768; size /= 2) {
+			short s = bulk_group(b, size), g = size / page_size, d = 0;
+			if (s < 0) continue;
+			for (short i = s; i < s + g && d >= 0; i++) {
+				block_t bl = get_next_block(i);
+				if (bl.flag() == TFS_BLF_DIRTY) d++;
+				else if (bl.get() != 0xffff) d = -1;
+			}
+			if (2 * d >= g && erase_bulk(s, g, size)) return true;
+		}
+		return false;
+	}
+#endif
+
+	// block doesn't need erase: descriptor says erased and every word is
+	// 0xff, reading it is much faster than erase
+	bool blank(short b)
+	{
+		if (read_block_desc(b) != 0xffff) return false;
+		unsigned int align4 buf[cache_size / 4];
+		for (unsigned int a = 0; a < page_size; a += cache_size) {
+			read_flash(flash_addr(b * page_size + a), buf, cache_size);
+			for (int i = 0; i < cache_size / 4; i++)
+				if (buf[i] != 0xffffffff) return false;
+		}
+		return true;
+	}
+
+	void read_wait()
+	{
+		#ifdef TFS_USE_ASYNC_READ
+			if (!_reading) return;
+			while (!C::flash_read_done()) C::do_yield();
+			_reading = false;
+		#endif
+	}
+
+	// no background operation blocks flash access
+	bool flash_idle()
+	{
+		#ifdef TFS_USE_ASYNC_ERASE
+			if (_erasing) return false;
+		#endif
+		#ifdef TFS_USE_ASYNC_READ
+			if (_reading) return false;
+		#endif
+		return true;
+	}
+
+	// pending write is and-ed to data read from flash, as program would do
+	bool merge_write_cache(block_t block, short offset, char *buf, short size)
+	{
+		if (!(_w_block.valid() && _w_block == block && _w_offs < offset + size && _w_offs + _w_size > offset)) return false;
+		short from = (_w_offs > offset ? _w_offs : offset);
+		short to = (_w_offs + _w_size < offset + size ? _w_offs + _w_size : offset + size);
+		for (short a = from; a < to; a++) buf[a - offset] &= _wcache[a - _w_offs];
+		return true;
+	}
 
 	void *get_cache(block_t block, short offset, short &size)
 	{
-		flush_write_cache();
-		// check if data is already in cache
-		if (!(_c_block.valid() && _c_block == block && offset >= _c_offs && offset < _c_offs + _c_size)) {
-			_c_block = block;
-			_c_offs = offset & (~3);
-			_c_size = TFS_CACHE_SIZE;
-			if (_c_offs + _c_size > TFS_PAGE_SIZE)
-				_c_size = TFS_PAGE_SIZE - _c_offs;
+		short loffs = offset & ~(cache_size - 1);
+	#ifndef TFS_USE_WRITE_BACK
+		// pending write to the same line has to reach flash first
+		if (_w_block.valid() && _w_block == block && _w_offs < loffs + cache_size && _w_offs + _w_size > loffs)
+			flush_write_cache();
+	#endif
 
-			flash_read(flash_addr(_c_block.no()*TFS_PAGE_SIZE + _c_offs), (unsigned int *)_cache, _c_size);
+		// check if data is already in cache
+		int ln;
+		for (ln = 0; ln < cache_lines; ln++)
+			if (_lines[ln].block.valid() && _lines[ln].block == block && _lines[ln].offs == loffs) break;
+		if (ln < cache_lines) _c_hits++;
+		else {
+			// replace empty or least recently used line
+			ln = 0;
+			for (int i = 0; i < cache_lines; i++) {
+				if (!_lines[i].block.valid()) {
+					ln = i;
+					break;
+				}
+				if ((unsigned short)(_c_clock - _lines[i].used) > (unsigned short)(_c_clock - _lines[ln].used)) ln = i;
+			}
+			_c_misses++;
+			_lines[ln].block = block;
+			_lines[ln].offs = loffs;
+			read_flash(flash_addr(block.no()*page_size + loffs), _cache[ln], cache_size);
 		}
-		size = _c_offs + _c_size - offset;
-		if (offset + size > TFS_BLOCK_SIZE)
-			size = TFS_BLOCK_SIZE - offset;
-		return &_cache[offset - _c_offs];
+		#ifdef TFS_USE_WRITE_BACK
+			if (merge_write_cache(block, loffs, _cache[ln], cache_size)) _w_merged = true;
+		#endif
+		_lines[ln].used = ++_c_clock;
+		size = loffs + cache_size - offset;
+		if (offset + size > block_size)
+			size = block_size - offset;
+		return &_cache[ln][offset - loffs];
+	}
+
+	// read from flash to buffer bypassing cache, offset has to be aligned to 4,
+	// buffer is aligned by reading little further and moving data back
+	// returns number of bytes read (size rounded down to 4)
+	int read_direct(block_t block, short offset, char *buf, int size)
+	{
+	#ifndef TFS_USE_WRITE_BACK
+		if (_w_block.valid() && _w_block == block && _w_offs < offset + size && _w_offs + _w_size > offset)
+			flush_write_cache();
+	#endif
+		short d = (4 - ((size_t)buf & 3)) & 3;
+		size = (size - d) & ~3;
+		read_flash(flash_addr(block.no()*page_size + offset), buf + d, size);
+		if (d) memmove(buf, buf + d, size);
+		#ifdef TFS_USE_WRITE_BACK
+			merge_write_cache(block, offset, buf, size);
+		#endif
+		return size;
+	}
+
+#ifdef TFS_USE_FLASH_MAP
+	// pointer to mapped data of block, pending write cache over it is
+	// programmed first and flash has to be idle while it is read
+	const char *map_flash(block_t block, short offset, short size)
+	{
+		if (_w_block.valid() && _w_block == block && _w_offs < offset + size && _w_offs + _w_size > offset)
+			flush_write_cache();
+		flash_wait();
+		return (const char *)C::flash_map(flash_addr(block.no()*page_size + offset), size);
 	}
+#endif
 
+	// read aligned window to aligned buffer bypassing cache, with
+	// TFS_USE_ASYNC_READ it is only started and read_wait() ends it
+	void read_start(block_t block, short offset, char *buf, short size)
+	{
+		if (_w_block.valid() && _w_block == block && _w_offs < offset + size && _w_offs + _w_size > offset)
+			flush_write_cache();
+		unsigned int addr = flash_addr(block.no()*page_size + offset);
+		#ifdef TFS_USE_ASYNC_READ
+			flash_wait();
+			C::flash_read_start(addr, (unsigned int *)buf, size);
+			_reading = true;
+			TFS_STAT(TFS_ADD(_stats.reads, 1); TFS_ADD(_stats.read_bytes, size));
+		#else
+			read_flash(addr, buf, size);
+		#endif
+	}
+
+	// size is number of bytes caller is going to write, on return number of
+	// bytes available in cache
 	void *get_write_cache(block_t block, short offset, short &size)
 	{
-		if (!(_c_size & 0x8000)) _c_block.invalidate();
-		short csize = _c_size & 0x7fff;
-		if (!(_c_block.valid() && _c_block == block && offset >= _c_offs && offset < _c_offs + csize)) {
+		#ifdef TFS_USE_WRITE_BACK
+			short req = size;
+		#endif
+		if (!(_w_block.valid() && _w_block == block && offset >= _w_offs && offset < _w_offs + _w_size)) {
 			flush_write_cache();
-			_c_block = block;
-			_c_offs = offset & (~3);
-			csize = TFS_CACHE_SIZE;
-			if (_c_offs + csize > TFS_PAGE_SIZE)
-				csize = TFS_PAGE_SIZE - _c_offs;
+			_w_block = block;
+		#ifdef TFS_USE_WRITE_BACK
+			// whole program page, only written part of it is programmed
+			_w_offs = offset & ~(cache_size - 1);
+			short csize = cache_size;
+			_w_lo = _w_hi = offset;
+			_w_merged = false;
+		#else
+			_w_offs = offset & (~3);
+			short csize = cache_size;
+			if (_w_offs + csize > page_size)
+				csize = page_size - _w_offs;
 
 		#ifdef TFS_LIMIT_WRITE_CACHE
-			register short reqsize = (size - csize + (offset - _c_offs) + TFS_CACHE_SIZE + 3) & (~3); // requested size rounded to 4
+			register short reqsize = (size - csize + (offset - _w_offs) + cache_size + 3) & (~3); // requested size rounded to 4
 			if (reqsize < csize) csize = reqsize;
 		#endif
-			memset(_cache, 0xff, csize);
-			_c_size = csize | 0x8000;
+		#endif
+			memset(_wcache, 0xff, csize);
+			_w_size = csize;
 		}
-		size = _c_offs + csize - offset;
-		if (offset + size > TFS_BLOCK_SIZE)
-			size = TFS_BLOCK_SIZE - offset;
-		return &_cache[offset - _c_offs];
+		// write which would need program of its own
+		else _w_saved++;
+		size = _w_offs + _w_size - offset;
+		if (offset + size > block_size)
+			size = block_size - offset;
+		#ifdef TFS_USE_WRITE_BACK
+			if (req > size) req = size;
+			if (offset < _w_lo) _w_lo = offset;
+			if (offset + req > _w_hi) _w_hi = offset + req;
+		#endif
+		return &_wcache[offset - _w_offs];
 	}
 
 	void flush_write_cache()
 	{
-		if (!(_c_block.valid() && _c_size & 0x8000)) return;
-		flash_write(flash_addr(_c_block.no()*TFS_PAGE_SIZE + _c_offs), (unsigned int *)_cache, _c_size & 0x7fff);
-		_c_block.invalidate();
+		if (!_w_block.valid()) return;
+		#ifdef TFS_USE_WRITE_BACK
+			short lo = _w_lo & ~3, hi = (_w_hi + 3) & ~3;
+			if (hi > lo) {
+				program(_w_block.no()*page_size + lo, &_wcache[lo - _w_offs], hi - lo);
+				_w_programs++;
+			}
+			// line with merged data is read again, data written over pending one
+			// (erase with mask) is not and-ed to it
+			if (_w_merged) invalidate_line(_w_block, _w_offs);
+		#else
+			program(_w_block.no()*page_size + _w_offs, _wcache, _w_size);
+			_w_programs++;
+		#endif
+		_w_block.invalidate();
+	}
+
+	// write to flash (address relative to file system) keeping read cache
+	// coherent, as in flash, programmed data is and-ed to cached
+	void program(unsigned int addr, void *data, short size)
+	{
+		#ifdef TFS_USE_CHECKPOINT
+			if (_cp_valid) cp_invalidate();
+		#endif
+		write_flash(flash_addr(addr), data, size);
+		for (int i = 0; i < cache_lines; i++) {
+			if (!_lines[i].block.valid()) continue;
+			unsigned int la = _lines[i].block.no()*page_size + _lines[i].offs;
+			if (addr >= la + cache_size || addr + size <= la) continue;
+			for (unsigned int a = (addr > la ? addr : la); a < addr + size && a < la + cache_size; a++)
+				_cache[i][a - la] &= ((char *)data)[a - addr];
+		}
 	}
 
 	union long_short {
@@ -199,22 +913,111 @@ protected:
 		struct { unsigned char c1, c2, c3, c4; } c;
 	};
 
+#ifdef TFS_USE_CHECKPOINT
+	unsigned int cp_sum(cp_header &h)
+	{
+		unsigned int s = h.gen ^ ((unsigned int)h.dir << 16 | h.nblocks);
+		unsigned int *t = (unsigned int *)_block_table;
+		for (int i = 0; i < cp_table / 4; i++) s = (s << 5 | s >> 27) ^ t[i];
+		return s;
+	}
+
+	void cp_invalidate()
+	{
+		unsigned int align4 l = 0;
+		write_flash(flash_addr((cp_slot + _cp_slot) * page_size + 8), &l, 4);
+		_cp_valid = false;
+	}
+
+	// newer of two checkpoints is used if it is still valid
+	bool cp_load(block_t &fb)
+	{
+		cp_header align4 h[2];
+		read_flash(flash_addr(cp_slot * page_size), &h[0], sizeof(cp_header));
+		read_flash(flash_addr((cp_slot + 1) * page_size), &h[1], sizeof(cp_header));
+		int s = -1;
+		for (int i = 0; i < 2; i++)
+			if (h[i].magic == TFS_CP_MAGIC && (s < 0 || (int)(h[i].gen - h[s].gen) > 0)) s = i;
+		_cp_valid = false;
+		_cp_slot = (s < 0 ? 1 : s);
+		_cp_gen = (s < 0 ? 0 : h[s].gen);
+		if (s < 0 || h[s].valid != 0xffffffff || h[s].nblocks != num_blocks || h[s].dir >= cp_slot) return false;
+		// directory it points to has to be of this format
+		unsigned int align4 l;
+		read_flash(flash_addr(h[s].dir * page_size), &l, 4);
+		if (l != dir_magic) return false;
+		read_flash(flash_addr((cp_slot + s) * page_size + sizeof(cp_header)), _block_table, cp_table);
+		if (cp_sum(h[s]) != h[s].sum) return false;
+
+		for (int i = 0; i < num_blocks; i++) {
+			map_block(i, _block_table[i].get());
+			register unsigned short f = _block_table[i].flag();
+			if (f == TFS_BLF_DIRTY) _free_blocks++;
+			else if (f == TFS_BLF_ERASED) {
+				_free_blocks++;
+				_erased_blocks++;
+			}
+		}
+		fb.set(h[s].dir);
+		_cp_valid = true;
+		return true;
+	}
+
+	// table is written before header so checkpoint is valid only when complete
+	void cp_write()
+	{
+		short slot = _cp_slot ^ 1;
+		unsigned int addr = flash_addr((cp_slot + slot) * page_size);
+		cp_header align4 h;
+		h.magic = TFS_CP_MAGIC;
+		h.gen = _cp_gen + 1;
+		h.valid = 0xffffffff;
+		h.dir = _dir._firstblock.no();
+		h.nblocks = num_blocks;
+		h.sum = cp_sum(h);
+		erase_flash(flash_sector(cp_slot + slot));
+		write_flash(addr + sizeof(h), _block_table, cp_table);
+		long_short align4 ls;
+		ls.l = 0xffffffff;
+		ls.c.c3 = TFS_CP_DESC >> 8;
+		ls.c.c4 = TFS_CP_DESC & 0xff;
+		write_flash(addr + page_size - 4, &ls.l, 4);
+		write_flash(addr, &h, sizeof(h));
+		_cp_slot = slot;
+		_cp_gen = h.gen;
+		_cp_valid = true;
+	}
+#endif
+
+	void map_block(int blockno, unsigned short desc)
+	{
+		#ifdef TFS_USE_FREE_MAP
+			unsigned int bit = 1u << (blockno & 31);
+			unsigned short f = desc >> 14;
+			if (f == TFS_BLF_ERASED) _erased_map[blockno >> 5] |= bit;
+			else _erased_map[blockno >> 5] &= ~bit;
+			if (f == TFS_BLF_DIRTY) _dirty_map[blockno >> 5] |= bit;
+			else _dirty_map[blockno >> 5] &= ~bit;
+		#endif
+		#ifdef TFS_USE_BLOCK_CACHE
+			_block_table[blockno].set(desc);
+		#endif
+	}
+
 	void write_block_desc(block_t block, unsigned short desc)
 	{
 		long_short align4 ls;
 		ls.l = 0xffffffff;
 		ls.c.c3 = (desc>>8);
 		ls.c.c4 = (desc & 0xff);
-		flash_write(flash_addr((block.no() + 1)*TFS_PAGE_SIZE - 4), &ls.l, 4);
-		#ifdef TFS_USE_BLOCK_CACHE
-			_block_table[block.no()].set(desc);
-		#endif
+		program((block.no() + 1)*page_size - 4, &ls.l, 4);
+		map_block(block.no(), desc);
 	}
 
 	unsigned short read_block_desc(int blockno)
 	{
 		long_short ls;
-		flash_read(flash_addr((blockno + 1)*TFS_PAGE_SIZE - 4), &ls.l, 4);
+		read_flash(flash_addr((blockno + 1)*page_size - 4), &ls.l, 4);
 		return (((unsigned short)ls.c.c3) << 8) | ((unsigned short)ls.c.c4);
 	}
 
@@ -234,9 +1037,33 @@ protected:
 		return get_next_block(block.no());
 	}
 
+#ifdef TFS_USE_FREE_MAP
+	// word scan starting after last erased block and wrapping around
+	bool find_block_in_map(block_t &bl, unsigned int *map)
+	{
+		int start = _last_block_erased + 1;
+		if (start >= num_blocks || start < 0) start = 0;
+		int w = start >> 5;
+		unsigned int m = map[w] & (~0u << (start & 31));
+		for (int n = 0; n <= map_words; n++) {
+			if (m) {
+				bl.set((w << 5) + __builtin_ctz(m));
+				return true;
+			}
+			if (++w == map_words) w = 0;
+			m = map[w];
+		}
+		return false;
+	}
+#endif
+
 	bool find_block_with_flag(block_t &bl, unsigned flag)
 	{
-		for (int i = _last_block_erased + 1; i < TFS_NUM_BLOCKS; i++)
+		#ifdef TFS_USE_FREE_MAP
+			if (flag == TFS_BLF_ERASED) return find_block_in_map(bl, _erased_map);
+			if (flag == TFS_BLF_DIRTY) return find_block_in_map(bl, _dirty_map);
+		#endif
+		for (int i = _last_block_erased + 1; i < num_blocks; i++)
 			if (get_next_block(i).flag() == flag) {
 				bl.set(i);
 				return true;
@@ -256,31 +1083,236 @@ protected:
 		// find empty block
 		if (!find_block_with_flag(bl, TFS_BLF_ERASED)) {
 			// if no empty blocks call clean dirty
-			if (!process_erase()) return false;
+			TFS_STAT(TFS_ADD(_stats.inline_erases, 1));
+			if (!process_erase(false)) return false;
+			#ifdef TFS_USE_ASYNC_ERASE
+				erase_wait();
+			#endif
+			if (!find_block_with_flag(bl, TFS_BLF_ERASED)) return false;
 		}
 		// when found set it to normal
 		block_t nbl;
 		nbl.set(-1, fl);
 		write_block_desc(bl, nbl.get());
 		_free_blocks--;
+		_erased_blocks--;
 		return true;
 	}
 
 public:
 	class File
 	{
-		friend TFS;
+		friend TFS_T;
 
 		public:
 	//protected:
-		short _offset, _curblock_no; // real offset = curblock_no*TFS_BLOCK_SIZE+offset
+		short _offset, _curblock_no; // real offset = curblock_no*block_size+offset
 		block_t _firstblock, _curblock, _lastbl; // file's first block and current block
 		short _fboffs, _lastblsize, _fileno;
+		short _endhint; // upper bound of data kept in directory, page size if not
+		short _lastbl_no, _ring; // ring file maximum blocks, 0 if not ring
+		unsigned char _dir_gen;
+		TFS_T *_fs; // file system of the open file, stays after close
+		// optional chain index, block number of every _chain_step-th block
+		unsigned short *_chain;
+		short _chain_size, _chain_step, _chain_known;
+		// optional buffer of this handle used instead of shared cache, it keeps
+		// window of block _buf_block, appended data if _buf_dirty
+		char *_buf;
+		short _buf_size, _buf_offs, _buf_len;
+		block_t _buf_block;
+		bool _buf_dirty;
+		// with read-ahead buffer is split in two halves, _buf_cur is offset of
+		// half with current window, other one gets window _ra_block/_ra_offs
+		// once reads are sequential (_ra_seq, cleared by seek)
+		short _buf_cur, _ra_offs, _ra_len;
+		block_t _ra_block;
+		bool _ra, _ra_seq;
+
+		// move to next block in chain and remember it in chain index
+		void next_block(block_t bl)
+		{
+			TFS_STAT(TFS_ADD(_fs->_stats.chain_steps, 1));
+			_curblock = bl;
+			_curblock_no++;
+			if (_chain && _chain_known < _chain_size && _curblock_no == _chain_known * _chain_step)
+				_chain[_chain_known++] = bl.no();
+		}
+
+		// last block is not searched on open, it is found once current block has no next
+		void check_tail()
+		{
+			if (!_lastbl.valid() && !_fs->get_next_block(_curblock).valid()) _fs->set_tail(*this, _curblock, _curblock_no);
+		}
+
+		// find last block from the furthest known one
+		void find_tail()
+		{
+			if (_lastbl.valid()) return;
+			if (_chain && (_chain_known - 1) * _chain_step > _curblock_no) {
+				block_t bl;
+				bl.set(_chain[_chain_known - 1]);
+				_fs->set_tail(*this, bl, (_chain_known - 1) * _chain_step);
+			}
+			else _fs->set_tail(*this, _curblock, _curblock_no);
+		}
+
+		// read window of current block to own buffer
+		void *buffer_read(short &size)
+		{
+			if (!(_buf_block.valid() && _buf_block == _curblock && _offset >= _buf_offs && _offset < _buf_offs + _buf_len)) {
+				if (_ra_block.valid() && _ra_block == _curblock && _offset >= _ra_offs && _offset < _ra_offs + _ra_len) {
+					// window read ahead becomes current
+					_fs->read_wait();
+					_buf_cur = _buf_size - _buf_cur;
+					_buf_block = _ra_block;
+					_buf_offs = _ra_offs;
+					_buf_len = _ra_len;
+				}
+				else {
+					ra_drop();
+					_buf_block = _curblock;
+					_buf_offs = _offset & ~3;
+					_buf_len = page_size - _buf_offs;
+					if (_buf_len > _buf_size) _buf_len = _buf_size;
+					_fs->read_direct(_curblock, _buf_offs, _buf + _buf_cur, _buf_len);
+				}
+				_ra_block.invalidate();
+				if (_ra && _ra_seq) read_ahead();
+				_ra_seq = true;
+			}
+			size = _buf_offs + _buf_len - _offset;
+			if (_offset + size > block_size)
+				size = block_size - _offset;
+			return &_buf[_buf_cur + _offset - _buf_offs];
+		}
+
+		// start reading window after current one to other half of buffer,
+		// following block is taken from chain, nothing is read past end of file
+		void read_ahead()
+		{
+			block_t bl = _buf_block;
+			short offs = _buf_offs + _buf_len;
+			if (offs >= block_size) {
+				if (_lastbl.valid() && bl == _lastbl) return;
+				bl = _fs->get_next_block(bl);
+				if (!bl.valid()) return;
+				offs = 0;
+			}
+			if (_lastbl.valid() && bl == _lastbl && offs >= _lastblsize) return;
+			_ra_block = bl;
+			_ra_offs = offs;
+			_ra_len = page_size - offs;
+			if (_ra_len > _buf_size) _ra_len = _buf_size;
+			_fs->read_start(bl, offs, _buf + _buf_size - _buf_cur, _ra_len);
+		}
+
+		// forget window read ahead, its read has to end before buffer is reused
+		void ra_drop()
+		{
+			if (!_ra_block.valid()) return;
+			_fs->read_wait();
+			_ra_block.invalidate();
+		}
+
+		// drop windows of own buffer when file changes under them or handle is reused
+		void drop_buffer()
+		{
+			flush();
+			ra_drop();
+			_buf_block.invalidate();
+			_ra_seq = true;
+		}
+
+		// reads which don't touch shared cache are done in parallel
+		bool shared_read()
+		{
+			#ifdef TFS_USE_ASYNC_READ
+				if (_ra) return false;
+			#endif
+			// unknown tail is found by walking block table and reading end of
+			// variable file directly, neither changes shared state
+			return _buf && !_buf_dirty && _fs && !_fs->_w_block.valid() && _fs->flash_idle();
+		}
+
+		// append to own buffer, previous content is programmed when it is
+		// full or end of file moved to other block
+		void *buffer_write(short &size)
+		{
+			if (!(_buf_dirty && _buf_block == _lastbl && _lastblsize >= _buf_offs && _lastblsize < _buf_offs + _buf_len)) {
+				flush();
+				ra_drop();
+				_buf_block = _lastbl;
+				_buf_offs = _lastblsize & ~3;
+				_buf_len = page_size - _buf_offs;
+				if (_buf_len > _buf_size) _buf_len = _buf_size;
+				memset(_buf + _buf_cur, 0xff, _buf_len);
+				_buf_dirty = true;
+			}
+			size = _buf_offs + _buf_len - _lastblsize;
+			if (_lastblsize + size > block_size)
+				size = block_size - _lastblsize;
+			return &_buf[_buf_cur + _lastblsize - _buf_offs];
+		}
+
+		TFS_T *owner()
+		{
+			return _fs;
+		}
 
 	public:
 		File()
 		{
-			_curblock.invalidate();
+			_fs = 0;
+			_curblock.set(0xffff);
+			_lastbl.set(0xffff);
+			_chain = 0;
+			_buf = 0;
+			_buf_dirty = false;
+			_buf_block.set(0xffff);
+			_ra_block.set(0xffff);
+			_ra = false;
+		}
+
+		// attach array for chain index, block number of every step-th block
+		// is stored as blocks are passed by read or seek so later seeks jump
+		// close to the target instead of walking the chain from the start
+		void set_chain_index(unsigned short *table, short entries, short step = 1)
+		{
+			_chain = table;
+			_chain_size = entries;
+			_chain_step = step < 1 ? 1 : step;
+			_chain_known = 0;
+			if (_curblock.valid() && entries > 0) table[_chain_known++] = _firstblock.no();
+		}
+
+		// attach buffer (aligned to 4) used only by this handle instead of shared
+		// cache, reads are done in chunks of its size and appends are programmed
+		// when it is full, on flush() or close(), null detaches it
+		// with read_ahead reads are done in chunks of half of it, while one half
+		// is consumed next chunk of sequential read is read to the other
+		void set_buffer(char *buf, short size, bool read_ahead = false)
+		{
+			TFS_LOCK;
+			drop_buffer();
+			if (_fs) _fs->flush_write_cache();
+			_buf = buf;
+			_ra = read_ahead && buf;
+			_buf_size = (_ra ? size / 2 : size) & ~3;
+			_buf_cur = 0;
+		}
+
+		// program appended data kept in own buffer, other handles of the same
+		// file see it after that
+		void flush()
+		{
+			if (!_buf_dirty) return;
+			TFS_LOCK;
+			short len = _buf_len;
+			if (_buf_block == _lastbl) len = (_lastblsize - _buf_offs + 3) & ~3;
+			if (len > 0) _fs->program(_buf_block.no()*page_size + _buf_offs, _buf + _buf_cur, len);
+			_buf_dirty = false;
+			_buf_block.invalidate();
 		}
 
 		~File()
@@ -290,31 +1322,45 @@ public:
 
 		int read(char *buf, int size)
 		{
+			TFS_LOCK_SHARED(shared_read());
+			TFS_TIME(TFS_OP_READ);
 			if (!_curblock.valid()) return -1;
+			flush();
 			if (_curblock == _lastbl && _offset + size > _lastblsize) {
 				if (_offset >= _lastblsize) return -1;
 				size = _lastblsize - _offset;
 			}
 			int sz = size;
 			while (sz > 0) {
-				short cs;
-				void *c = tfs.get_cache(_curblock, _offset, cs);
-				if (cs > 0) {
-					if (cs > sz) cs = sz;
-					memcpy(buf, c, cs);
-					sz -= cs;
-					buf += cs;
-					_offset += cs;
+				int ds = block_size - _offset;
+				if (ds > sz) ds = sz;
+				if (ds >= (_buf ? _buf_size : (short)cache_size) && !(_offset & 3)) {
+					// cache line or more within block is read directly to buffer
+					ds = _fs->read_direct(_curblock, _offset, buf, ds);
+					sz -= ds;
+					buf += ds;
+					_offset += ds;
 				}
-				if (_offset >= TFS_BLOCK_SIZE) {
-					block_t bl = tfs.get_next_block(_curblock);
+				else {
+					short cs;
+					void *c = (_buf ? buffer_read(cs) : _fs->get_cache(_curblock, _offset, cs));
+					if (cs > 0) {
+						if (cs > sz) cs = sz;
+						memcpy(buf, c, cs);
+						sz -= cs;
+						buf += cs;
+						_offset += cs;
+					}
+				}
+				if (_offset >= block_size) {
+					block_t bl = _fs->get_next_block(_curblock);
 					if (!bl.valid()) {
-						_offset = TFS_BLOCK_SIZE;
+						_offset = block_size;
 						return (size - sz);
 					}
-					_curblock = bl;
-					_curblock_no++;
-					_offset -= TFS_BLOCK_SIZE;
+					next_block(bl);
+					_offset -= block_size;
+					check_tail();
 					if (_curblock == _lastbl && _offset + sz > _lastblsize) {
 						register int cut = _lastblsize - _offset;
 						size -= sz - cut;
@@ -325,26 +1371,73 @@ public:
 			return size;
 		}
 
+#ifdef TFS_USE_FLASH_MAP
+		// map file data at current position instead of reading it, size is
+		// maximum number of bytes wanted and on return number of bytes mapped
+		// (up to end of current block or file), position moves over them,
+		// returns 0 at end of file or if flash isn't mapped there, pointer is
+		// valid until the file is written or removed or flash is erased
+		const char *map(int &size)
+		{
+			TFS_LOCK;
+			TFS_TIME(TFS_OP_READ);
+			int max = size;
+			size = 0;
+			if (!_curblock.valid() || max <= 0) return 0;
+			flush();
+			if (_offset >= block_size) {
+				block_t bl = _fs->get_next_block(_curblock);
+				if (!bl.valid()) return 0;
+				next_block(bl);
+				_offset -= block_size;
+				check_tail();
+			}
+			int end = (_curblock == _lastbl ? _lastblsize : (short)block_size);
+			if (_offset >= end) return 0;
+			if (max > end - _offset) max = end - _offset;
+			const char *p = _fs->map_flash(_curblock, _offset, max);
+			if (p) {
+				size = max;
+				_offset += max;
+			}
+			return p;
+		}
+#endif
+
 		// seek, from beginning of the file
 		bool seek(int offset)
 		{
+			TFS_LOCK_SHARED(_lastbl.valid() && _fs && _fs->flash_idle());
+			TFS_TIME(TFS_OP_SEEK);
 			if (!_curblock.valid()) return false;
-			int blockno = offset / TFS_BLOCK_SIZE;
+			_ra_seq = false;
 			offset += _fboffs;
+			int blockno = offset / block_size;
 			if (_curblock_no > blockno) {
 				_curblock_no = 0;
 				_curblock = _firstblock;
 			}
-			for (; _curblock_no < blockno; _curblock_no++) {
-				block_t bl = tfs.get_next_block(_curblock);
+			if (_chain) {
+				// jump to the closest indexed block before target
+				int i = blockno / _chain_step;
+				if (i >= _chain_known) i = _chain_known - 1;
+				if (i * _chain_step > _curblock_no) {
+					_curblock.set(_chain[i]);
+					_curblock_no = i * _chain_step;
+				}
+			}
+			while (_curblock_no < blockno) {
+				block_t bl = _fs->get_next_block(_curblock);
 				if (!bl.valid()) {
+					if (!_lastbl.valid()) _fs->set_tail(*this, _curblock, _curblock_no);
 					_offset = _lastblsize;
 					return false;
 				}
-				_curblock = bl;
+				next_block(bl);
 			}
 
-			_offset = offset % TFS_BLOCK_SIZE;
+			_offset = offset % block_size;
+			check_tail();
 			if (_curblock == _lastbl && _offset > _lastblsize) {
 				_offset = _lastblsize;
 				return false;
@@ -352,31 +1445,54 @@ public:
 			return true;
 		}
 
+		// append data, zeroes if buf is null
 		int write(const char *buf, int size)
 		{
-			if (!_curblock.valid()) return -1;
+			TFS_LOCK;
+			TFS_TIME(TFS_OP_WRITE);
+			// views of compound or packed files are read only
+			if (!_curblock.valid() || _fboffs) return -1;
+			find_tail();
+			if (_ring && _lastblsize + size > block_size && size <= block_size) {
+				// records of ring file don't cross blocks, so the oldest one starts
+				// at the beginning of the first block, rest of the block is zeroed
+				short pad = block_size - _lastblsize;
+				if (write(0, pad) != pad) return 0;
+			}
 			int sz = size;
 			while (sz > 0) {
+				if (_endhint < page_size && _lastblsize + sz > _endhint) _fs->raise_end_hint(*this, _lastblsize + sz);
 				short cs = sz;
-				void *c = tfs.get_write_cache(_lastbl, _lastblsize, cs);
+				void *c = (_buf ? buffer_write(cs) : _fs->get_write_cache(_lastbl, _lastblsize, cs));
 				if (cs > 0) {
 					if (cs > sz) cs = sz;
-					memcpy(c, buf, cs);
+					if (buf) {
+						memcpy(c, buf, cs);
+						buf += cs;
+					}
+					else memset(c, 0, cs);
 					sz -= cs;
-					buf += cs;
 					_lastblsize += cs;
 				}
-				if (_lastblsize >= TFS_BLOCK_SIZE) {
+				if (_lastblsize >= block_size) {
+					// full ring drops its oldest block, if it can't the write fails
+					// rather than ring grows over its limit
+					if (_ring && _lastbl_no + 1 >= _ring && !_fs->ring_recycle(*this)) {
+						_lastblsize = block_size;
+						return (size - sz);
+					}
 					block_t bl;
-					if (!tfs.new_write_block(bl)) {
-						_lastblsize = TFS_BLOCK_SIZE;
+					if (!_fs->new_write_block(bl)) {
+						_lastblsize = block_size;
 						return (size - sz);
 					}
-					bl.set_flag(TFS_BLF_NORMAL);
-					tfs.write_block_desc(_lastbl, bl.get());
-					tfs._free_blocks--;
+					// link keeps flag of last block, first block of directory is system
+					bl.set_flag(_fs->get_next_block(_lastbl).flag());
+					_fs->write_block_desc(_lastbl, bl.get());
 					_lastbl = bl;
-					_lastblsize -= TFS_BLOCK_SIZE;
+					_lastbl_no++;
+					_lastblsize -= block_size;
+					_endhint = page_size;
 				}
 			}
 			return size;
@@ -385,7 +1501,10 @@ public:
 		// fill portion of the file with zeroes
 		bool erase(int pos, int size, char mask=0)
 		{
+			TFS_LOCK;
 			if (!_curblock.valid()) return false;
+			drop_buffer();
+			find_tail();
 			int oldpos = position();
 			if (!seek(pos)) {
 				seek(oldpos);
@@ -398,18 +1517,18 @@ public:
 			seek(oldpos);
 			while (sz > 0) {
 				short cs = sz;
-				void *c = tfs.get_write_cache(erb, offset, cs);
+				void *c = _fs->get_write_cache(erb, offset, cs);
 				if (cs > 0) {
 					if (cs > sz) cs = sz;
 					memset(c, mask, cs);
 					sz -= cs;
 					offset += cs;
 				}
-				if (offset >= TFS_BLOCK_SIZE) {
-					block_t bl = tfs.get_next_block(erb);
+				if (offset >= block_size) {
+					block_t bl = _fs->get_next_block(erb);
 					if (!bl.valid()) return false;
 					erb = bl;
-					offset -= TFS_BLOCK_SIZE;
+					offset -= block_size;
 					if (erb == _lastbl && offset + sz > _lastblsize) {
 						register int cut = _lastblsize - offset;
 						size -= sz - cut;
@@ -422,20 +1541,26 @@ public:
 
 		int position()
 		{
-			return (_curblock.valid() ? (int)_curblock_no * TFS_BLOCK_SIZE + (int)_offset : -1);
+			return (_curblock.valid() ? (int)_curblock_no * block_size + (int)_offset - _fboffs : -1);
 		}
 
 		// duplicate file handle
 		// useful for compound files
 		void dup(File &f, int position=0, int size=-1)
 		{
-			memcpy(&f, this, sizeof(f));
+			TFS_LOCK;
+			flush();
+			f = *this; // member copy, buffer and chain index stay with this one
+			f._chain = 0;
+			f._buf = 0;
+			f._ra_block.invalidate();
+			f._ra = false;
 			if (!_curblock.valid()) return;
 			if (position) {
 				seek(position);
 				f._firstblock = f._curblock = _curblock;
-				f._fboffs = _offset;
-				f._offset = f._curblock_no = 0;
+				f._fboffs = f._offset = _offset;
+				f._curblock_no = 0;
 			}
 			if (size >= 0) {
 				seek(position + size);
@@ -447,16 +1572,27 @@ public:
 		// close for read or as variable size
 		void close()
 		{
-			tfs.flush_write_cache();
+			TFS_LOCK;
+			TFS_TIME(TFS_OP_CLOSE);
+			flush();
+			ra_drop();
+			if (_fs) _fs->flush_write_cache();
 			_curblock.invalidate();
 		}
 
 		// closes file as fixed size file
-		void close_fixed()
+		// returns false if file couldn't be fixed (no directory space for
+		// ring file), it is closed as variable then
+		bool close_fixed()
 		{
-			tfs.flush_write_cache();
-			tfs.do_fix_size(_fileno, _lastblsize);
+			TFS_LOCK;
+			TFS_TIME(TFS_OP_CLOSE);
+			if (!_curblock.valid()) return false;
+			flush();
+			_fs->flush_write_cache();
+			bool ok = (_fboffs || _fs->fix_size(*this, _lastblsize));
 			_curblock.invalidate();
+			return ok;
 		}
 
 		bool isopen()
@@ -469,43 +1605,250 @@ public:
 			return (isopen() == b);
 		}
 
-		int read()
-		{
-			char c;
-			if (read(&c, 1) == 1) return c;
-			return -1;
-		}
-	};
+		int read()
+		{
+			char c;
+			if (read(&c, 1) == 1) return c;
+			return -1;
+		}
+	};
+
+#ifdef TFS_USE_STATS
+public:
+	// counters kept with TFS_USE_STATS, see stats()
+	struct stats_t {
+		unsigned int reads, read_bytes; // flash reads, also background ones
+		unsigned int writes, write_bytes;
+		unsigned int erases;
+		unsigned int cache_hits, cache_misses; // as cache_stats()
+		unsigned int wc_programs; // write cache programs, as write_stats()
+		unsigned int inline_erases; // erases done because write found no erased block
+		unsigned int chain_steps; // blocks passed walking file chains
+		unsigned int dir_defrags;
+	#ifdef TFS_USE_STATS_CLOCK
+		unsigned int hist[TFS_OPS][TFS_HIST_BUCKETS]; // latency per TFS_OP_*
+	#endif
+	};
+
+protected:
+	stats_t _stats;
+#else
+protected:
+#endif
+#ifdef TFS_USE_STATS_CLOCK
+	short _op_depth; // nesting of timed functions
+
+	void stats_time(short op, unsigned int us)
+	{
+		short n = 0;
+		while (n < TFS_HIST_BUCKETS - 1 && us >= (1u << n)) n++;
+		TFS_ADD(_stats.hist[op][n], 1);
+	}
+#endif
+	TFS_T *owner()
+	{
+		return this;
+	}
+
+	static TFS_T *_instance; // last initialized, listed by Dir()
+	File _dir;
+	block_t _pack; // block where new packed files are added
+	short _pack_used; // -1 if not known yet
+	short _no_del_files;
+	unsigned char _dir_gen; // changed when file numbers change
+	struct file_desc {
+		char name[name_size];
+		block_t first_block;
+		short size; // in last bl
+	};
+
+	// name of full name_size is stored without terminating zero
+	static void copy_name(char *dst, const char *name)
+	{
+		memset(dst, 0, name_size);
+		memcpy(dst, name, strnlen(name, name_size));
+	}
+
+#ifdef TFS_USE_DIR_INDEX
+	// open addressing hash of live directory entries
+	struct dir_index_t {
+		unsigned short hash;
+		short fileno; // -1 empty
+	};
+	dir_index_t _dir_index[TFS_DIR_INDEX_SIZE];
+	short _dir_index_used;
+	bool _dir_index_ok;
+
+	static unsigned short name_hash(const char *name)
+	{
+		unsigned int h = 2166136261u;
+		for (int i = 0; i < name_size && name[i]; i++)
+			h = (h ^ (unsigned char)name[i]) * 16777619u;
+		return (unsigned short)(h ^ (h >> 16));
+	}
+
+	void dir_index_reset()
+	{
+		memset(_dir_index, 0xff, sizeof(_dir_index));
+		_dir_index_used = 0;
+		_dir_index_ok = true;
+	}
+
+	void dir_index_add(const char *name, short fileno)
+	{
+		if (!_dir_index_ok) return;
+		unsigned short h = name_hash(name);
+		// index over budget, use directory scan until it is rebuilt
+		if (_dir_index_used >= TFS_DIR_INDEX_SIZE * 3 / 4) {
+			_dir_index_ok = false;
+			return;
+		}
+		int i = h & (TFS_DIR_INDEX_SIZE - 1);
+		while (_dir_index[i].fileno >= 0) i = (i + 1) & (TFS_DIR_INDEX_SIZE - 1);
+		_dir_index_used++;
+		_dir_index[i].hash = h;
+		_dir_index[i].fileno = fileno;
+	}
+
+	// entries after removed one are moved back, so there are no deleted
+	// marks and removed slots count to the budget no more
+	void dir_index_remove(const char *name, short fileno)
+	{
+		if (!_dir_index_ok) return;
+		int i = name_hash(name) & (TFS_DIR_INDEX_SIZE - 1);
+		while (_dir_index[i].fileno != fileno) {
+			if (_dir_index[i].fileno == -1) return;
+			i = (i + 1) & (TFS_DIR_INDEX_SIZE - 1);
+		}
+		for (int j = (i + 1) & (TFS_DIR_INDEX_SIZE - 1); _dir_index[j].fileno != -1; j = (j + 1) & (TFS_DIR_INDEX_SIZE - 1)) {
+			int k = _dir_index[j].hash & (TFS_DIR_INDEX_SIZE - 1);
+			// entry stays if its home slot is cyclically in (i, j]
+			if (i <= j ? (k > i && k <= j) : (k > i || k <= j)) continue;
+			_dir_index[i] = _dir_index[j];
+			i = j;
+		}
+		_dir_index[i].fileno = -1;
+		_dir_index_used--;
+	}
+#endif
+
+	// program 1 or 2 bytes (at even offset) through aligned word, directory
+	// entries are not aligned in blocks after the first one
+	void program_bytes(block_t bl, short offs, unsigned short value, short len)
+	{
+		long_short align4 ls;
+		ls.l = 0xffffffff;
+		memcpy((char *)&ls + (offs & 3), &value, len);
+		program(bl.no()*page_size + (offs & ~3), &ls.l, 4);
+	}
+
+	// program field of directory entry at offs
+	void dir_program(short fno, short offs, unsigned short value, short len)
+	{
+		_dir.seek(4 + fno * sizeof(file_desc) + offs);
+		program_bytes(_dir._curblock, _dir._offset, value, len);
+	}
+
+	void do_fix_size(short fno, short size)
+	{
+		dir_program(fno, name_size + 2, size, 2);
+	}
+
+	static bool is_packed(file_desc &fd)
+	{
+		return fd.size >= 0 && (fd.size & TFS_PACKED);
+	}
+
+	static bool is_pending(file_desc &fd)
+	{
+		return (fd.first_block.get() & TFS_PENDING) && fd.first_block.get() != 0xffff;
+	}
+
+	// clear name, entry is deleted
+	void clear_entry(short fno)
+	{
+		dir_program(fno, 0, 0, 1);
+		_no_del_files++;
+	}
+
+	// clear pending flag of first block, entry is in effect
+	void commit_entry(short fno, file_desc &fd)
+	{
+		fd.first_block.set(fd.first_block.get() & ~TFS_PENDING);
+		dir_program(fno, name_size, fd.first_block.get(), 2);
+	}
+
+	// file number of opened file, after directory defragmentation it is
+	// found again by its first block
+	short file_entry(File &f)
+	{
+		if (f._dir_gen != _dir_gen) {
+			file_desc fd;
+			_dir.seek(4);
+			for (short fno = 0; _dir.read((char*)&fd, sizeof(fd)) == (int)sizeof(fd) && fd.name[0] != minusone; fno++)
+				if (fd.name[0] && fd.first_block == f._firstblock) {
+					f._fileno = fno;
+					break;
+				}
+			f._dir_gen = _dir_gen;
+		}
+		return f._fileno;
+	}
+
+	static short end_hint(short size)
+	{
+		short n = 0;
+		for (unsigned short m = ~size & hint_mask; m; m &= m - 1) n++;
+		return (n && n < hint_bits ? n * hint_unit : page_size);
+	}
 
-protected:
-	File _dir;
-	short _no_del_files;
-	struct file_desc {
-		char name[TFS_NAME_SIZE];
-		block_t first_block;
-		short size; // in last bl
-	};
+	// clear hint bits before data reaching end is written
+	void raise_end_hint(File &f, int end)
+	{
+		short n = (end - 1) / hint_unit + 1;
+		if (n > hint_bits) n = hint_bits;
+		do_fix_size(file_entry(f), (short)((~(((1 << n) - 1) << hint_shift) & ~TFS_RING_NONE) | (f._ring ? f._ring : TFS_RING_NONE)));
+		f._endhint = (n < hint_bits ? n * hint_unit : page_size);
+	}
 
-	void do_fix_size(short fno, short size)
+	void mark_chain(unsigned char *marker, block_t bl)
 	{
-		_dir.seek(4 + fno * sizeof(file_desc) + TFS_NAME_SIZE);
-		block_t bl = _dir._curblock;
-		short offs = _dir._offset;
-		long_short align4 ls;
-		ls.l = 0xffffffff;
-		ls.s.s2 = size;
-		flash_write(flash_addr(bl.no()*TFS_PAGE_SIZE + offs), &ls.l, 4);
+		for (; bl.valid(); bl = get_next_block(bl))
+			marker[bl.no() / 8] |= (1 << (bl.no() & 7));
+	}
+
+	// make blocks of the chain dirty in one pass, entry pointing to it has
+	// to be cleared first so rest of the chain is lost block if interrupted
+	void retire_chain(block_t bl)
+	{
+		while (bl.valid()) {
+			block_t nbl = get_next_block(bl);
+			if (nbl.flag() != TFS_BLF_NORMAL) break;
+			write_block_desc(bl, 0);
+			_free_blocks++;
+			bl = nbl;
+		}
 	}
 
 	void init_dir_file(block_t fb, bool checkfs=true)
 	{
-		unsigned char marker[(TFS_NUM_BLOCKS + 7) / 8] = { 0 };
+		unsigned char marker[(num_blocks + 7) / 8] = { 0 };
 
+		_dir._fs = this;
 		_dir._firstblock = _dir._curblock = fb;
-		_dir._curblock_no = _dir._fboffs = 0;
+		_dir._curblock_no = _dir._fboffs = _dir._lastbl_no = _dir._ring = 0;
 		_dir._offset = 4;
 		_dir._lastbl.set(-1);
+		_dir._lastblsize = block_size;
+		_dir._endhint = page_size;
+		_dir._chain = 0;
+		_dir_gen++;
 		_no_del_files = 0;
+		_pack.invalidate();
+		short pending = 0;
+		#ifdef TFS_USE_DIR_INDEX
+			dir_index_reset();
+		#endif
 
 		// _dir set file end
 		for (int fileno = 0; true; fileno++) {
@@ -522,27 +1865,63 @@ protected:
 			}
 			else {
 				// check if file created but no blocks used
-				if (fd.first_block.get() == 0xffff) {
-					long_short align4 ls;
-					ls.l = 0xffffffff;
-					ls.c.c1 = 0;
-					flash_write(flash_addr(bl.no()*TFS_PAGE_SIZE + offs), &ls.l, 4);
+				if (fd.first_block.get() == 0xffff) program_bytes(bl, offs, 0, 1);
+				else if (is_pending(fd)) {
+					pending++;
+					if (checkfs) mark_chain(marker, fd.first_block);
 				}
 				else {
+					#ifdef TFS_USE_DIR_INDEX
+						dir_index_add(fd.name, fileno);
+					#endif
+					// packed files are added to block of the last one
+					if (is_packed(fd)) {
+						_pack.set(fd.first_block.no());
+						_pack_used = -1;
+					}
 					// check file chains - iterate on file blocks and mark it
-					for (block_t ble = fd.first_block; ble.valid(); ble = get_next_block(ble))
-						marker[ble.no() / 8] |= (1 << (ble.no() & 7));
+					if (checkfs) mark_chain(marker, fd.first_block);
+				}
+			}
+		}
+
+		if (pending) {
+			// entries left pending by interruption: shadow which was not committed
+			// is dropped, otherwise commit is finished by clearing older entry
+			for (short fno = 0; fno < _next_file; fno++) {
+				file_desc fd, ofd;
+				if (!read_file_desc(fno, fd) || !fd.name[0] || !is_pending(fd)) continue;
+				if (fd.first_block.get() & TFS_SHADOW) {
+					clear_entry(fno);
+					continue;
 				}
+				for (short o = 0; o < fno; o++)
+					if (read_file_desc(o, ofd) && ofd.name[0] && !is_pending(ofd) && !strncmp(ofd.name, fd.name, name_size)) {
+						#ifdef TFS_USE_DIR_INDEX
+							dir_index_remove(ofd.name, o);
+						#endif
+						clear_entry(o);
+					}
+				commit_entry(fno, fd);
+				#ifdef TFS_USE_DIR_INDEX
+					dir_index_add(fd.name, fno);
+				#endif
+			}
+			// blocks of cleared entries are lost now, mark again and check
+			memset(marker, 0, sizeof(marker));
+			for (short fno = 0; fno < _next_file; fno++) {
+				file_desc fd;
+				if (read_file_desc(fno, fd) && fd.name[0] && !is_pending(fd)) mark_chain(marker, fd.first_block);
 			}
+			checkfs = true;
 		}
 
 		if (checkfs) {
 			// mark dir chains also
-			for (block_t bl = fb; bl.valid(); bl = get_next_block(bl))
-				marker[bl.no() / 8] |= (1 << (bl.no() & 7));
+			mark_chain(marker, fb);
 
 			// check for lost blocks
-			for (int i = 0; i < TFS_NUM_BLOCKS; i++) {
+			for (int i = 0; i < num_blocks; i++) {
 				if (!(marker[i / 8] & (1 << (i & 7)))) {
 					block_t bl = get_next_block(i);
 					if (bl.flag() == TFS_BLF_NORMAL) {
@@ -553,7 +1932,7 @@ protected:
 				}
 			}
 			// reset (read) cache with directory
-			_c_block.invalidate();
+			invalidate_cache();
 		}
 	}
 
@@ -562,99 +1941,321 @@ public:
 
 	bool init(short lastblockerased=0) // akka mount
 	{
+		TFS_LOCK;
+		_instance = this;
 		// FS sanity checks
 		//- (write/create) new block is made but not chained on previous/no file entry in root
 		//- (remove)dir entry is nulled but not (all)blocks are made dirty
 		//- (defrag) two system files - two magic? use smaller, delete other or one without magic
 
+		_formatting = 0;
+		#ifdef TFS_USE_ASYNC_ERASE
+			erase_wait();
+		#endif
 		_last_block_erased = lastblockerased;
-		_free_blocks = 0;
+		_free_blocks = _erased_blocks = 0;
+		#ifdef TFS_USE_FREE_MAP
+			memset(_erased_map, 0, sizeof(_erased_map));
+			memset(_dirty_map, 0, sizeof(_dirty_map));
+		#endif
 		// find _dir file and cache block info
 		block_t bl, fb;
-		fb.invalidate();
-		_c_block.invalidate();
-		for (int i = 0; i < TFS_NUM_BLOCKS; i++) {
-			bl.set(read_block_desc(i));
-			#ifdef TFS_USE_BLOCK_CACHE
-				_block_table[i] = bl;
+		int stray = 0;
+		fb.set(0xffff);
+		invalidate_cache();
+		_w_block.invalidate();
+		#ifdef TFS_USE_CHECKPOINT
+			if (cp_load(fb)) {
+				init_dir_file(fb, false);
+				return true;
+			}
+		#endif
+		for (int i = 0; i < num_blocks; i++) {
+			#ifdef TFS_USE_CHECKPOINT
+				if (i >= cp_slot) {
+					map_block(i, TFS_CP_DESC);
+					continue;
+				}
 			#endif
+			bl.set(read_block_desc(i));
+			map_block(i, bl.get());
 			register unsigned short f = bl.flag();
 			if (f == TFS_BLF_SYSTEM) {
 				unsigned int l;
-				flash_read(flash_addr(i*TFS_PAGE_SIZE), &l, 4);
-				if (l == TFS_MAGIC && !fb.valid())
+				read_flash(flash_addr(i*page_size), &l, 4);
+				if (l == dir_magic && !fb.valid())
 					fb.set(i);
-				else {
-					bl.set(i);
-					write_block_desc(bl, 0);
-					_free_blocks++;
-				}
+				else stray++;
+			}
+			else if (f == TFS_BLF_DIRTY) _free_blocks++;
+			else if (f == TFS_BLF_ERASED) {
+				_free_blocks++;
+				_erased_blocks++;
 			}
-			else if (f == TFS_BLF_DIRTY || f == TFS_BLF_ERASED) _free_blocks++;
 		}
 		if (!fb.valid()) return false;
+		// old directory heads are freed only once own directory is found, so
+		// flash with other format (see detect()) isn't written
+		for (int i = 0; stray && i < num_blocks; i++) {
+			bl = get_next_block(i);
+			if (i == fb.no() || bl.get() == TFS_CP_DESC || bl.flag() != TFS_BLF_SYSTEM) continue;
+			bl.set(i);
+			write_block_desc(bl, 0);
+			_free_blocks++;
+			stray--;
+		}
 		init_dir_file(fb);
 		return true;
 	}
 
+	// block size of file system found in flash area of this instance, 0 if
+	// there is none, init() mounts only file system with own block size (and
+	// only if it was formatted with the same TFS_USE_CHECKPOINT setting)
+	int detect()
+	{
+		TFS_LOCK;
+		for (unsigned int a = 0; a < (unsigned int)num_blocks * page_size; a += sector_size) {
+			unsigned int l;
+			read_flash(flash_addr(a), &l, 4);
+			unsigned int p = (((l - TFS_MAGIC) & 0xff) << 8) ^ 4096;
+			if (l - TFS_MAGIC >= 0x200 || p < 256 || p > 16384 || (p & (p - 1)) || a % p) continue;
+			long_short ls;
+			read_flash(flash_addr(a + p - 4), &ls.l, 4);
+			if ((ls.c.c3 >> 6) == TFS_BLF_SYSTEM) return p;
+		}
+		return 0;
+	}
+
 	void format()
 	{
-		for (int i = 0; i < TFS_NUM_BLOCKS; i++) {
-			do_yield();
-			flash_erase_sector(flash_sector(i));
+		format_start();
+		while (step()) C::do_yield();
+	}
+
+	// start format which is done by calls to step(), other functions can be
+	// used after step() returns false
+	void format_start()
+	{
+		TFS_LOCK;
+		_instance = this;
+		invalidate_cache();
+		_w_block.invalidate();
+		_formatting = 1;
+	}
+
+	// do bounded part of background work, format started by format_start()
+	// or erase of dirty blocks while less than TFS_ERASE_RESERVE are erased,
+	// at most one block is erased (with TFS_USE_ASYNC_ERASE erase is only
+	// started or polled, bulk erase is left to format and erase_idle()) or directory is compacted when it has TFS_DIR_DEFRAG
+	// deleted entries, returns true while there is more work
+	bool step()
+	{
+		TFS_LOCK;
+		TFS_TIME(TFS_OP_STEP);
+		#ifdef TFS_USE_ASYNC_ERASE
+			if (_erasing && !erase_poll()) return true;
+		#endif
+		if (_formatting) {
+			if (_formatting <= num_blocks) {
+				format_erase();
+				return true;
+			}
+			format_finish();
+			return false;
+		}
+		if (erase_needed()) {
+			process_erase(false);
+			return true;
+		}
+		if (dir_defrag_needed()) {
+			defrag_dir_file();
+			return true;
 		}
+		return false;
+	}
+
+protected:
+	// erase next part of flash while formatting, blank blocks are skipped,
+	// with bulk erase whole chip or aligned groups which aren't blank are
+	// erased at once (chip only if first block isn't blank, empty chip is
+	// checked faster than erased)
+	void format_erase()
+	{
+		short b = _formatting - 1;
+		#ifdef TFS_USE_BULK_ERASE
+			if (!b && C::chip_size != 0 && C::flash_offs == 0 && (unsigned int)num_blocks * page_size == C::chip_size &&
+				!blank(0) && erase_bulk(0, num_blocks, 0)) {
+				_formatting = num_blocks + 1;
+				return;
+			}
+			for (unsigned int size = 65536; size >= 32768; size /= 2) {
+				short g = size / page_size;
+				if (bulk_group(b, size) != b) continue;
+				short n = 0;
+				while (n < g && blank(b + n)) n++;
+				if (n < g && !erase_bulk(b, g, size)) continue;
+				_formatting += g;
+				return;
+			}
+		#endif
+		_formatting++;
+		if (blank(b)) return;
+		block_t bl;
+		bl.set(b);
+		erase_start(bl);
+	}
+
+	void format_finish()
+	{
+		_formatting = 0;
 		#ifdef TFS_USE_BLOCK_CACHE
 			memset(_block_table, 0xff, sizeof(_block_table));
 		#endif
+		#ifdef TFS_USE_FREE_MAP
+			memset(_erased_map, 0, sizeof(_erased_map));
+			memset(_dirty_map, 0, sizeof(_dirty_map));
+			for (int i = 0; i < num_blocks; i++) _erased_map[i >> 5] |= 1u << (i & 31);
+		#endif
 		block_t b, nxt;
 		b.set(0);
 		nxt.set(-1, TFS_BLF_SYSTEM);
 		write_block_desc(b, nxt.get());
-		unsigned int align4 l = TFS_MAGIC;
-		flash_write(flash_addr(0), &l, 4);
-		_free_blocks = TFS_NUM_BLOCKS - 1;
+		unsigned int align4 l = dir_magic;
+		program(0, &l, 4);
+		_free_blocks = _erased_blocks = num_blocks - 1;
+		#ifdef TFS_USE_CHECKPOINT
+			for (int i = cp_slot; i < num_blocks; i++) map_block(i, TFS_CP_DESC);
+			_free_blocks = _erased_blocks = cp_slot - 1;
+			_cp_valid = false;
+			_cp_slot = 1;
+			_cp_gen = 0;
+		#endif
 
-		_c_block.invalidate();
 		init_dir_file(b, false);
 	}
 
+public:
+	// flush pending write and, if enabled, write checkpoint so next init()
+	// is fast, call before shutdown
+	void sync()
+	{
+		TFS_LOCK;
+		flush_write_cache();
+		#ifdef TFS_USE_CHECKPOINT
+			if (!_cp_valid) cp_write();
+		#endif
+	}
+
+	// full consistency check as done by init() after unclean shutdown,
+	// chains of all files are walked and lost blocks are made dirty
+	void check()
+	{
+		TFS_LOCK;
+		flush_write_cache();
+		init_dir_file(_dir._firstblock);
+	}
+
 protected:
+	bool read_file_desc(short fileno, file_desc &fd)
+	{
+		return _dir.seek(4 + fileno * sizeof(file_desc)) && _dir.read((char*)&fd, sizeof(fd)) == (int)sizeof(fd);
+	}
+
 	int find_file_desc(const char *name, file_desc &fd)
 	{
+		#ifdef TFS_USE_DIR_INDEX
+		if (_dir_index_ok) {
+			// only entries with matching hash are read to compare names, first one in directory wins
+			unsigned short h = name_hash(name);
+			short found = -1;
+			for (int i = h & (TFS_DIR_INDEX_SIZE - 1); _dir_index[i].fileno != -1; i = (i + 1) & (TFS_DIR_INDEX_SIZE - 1)) {
+				short fno = _dir_index[i].fileno;
+				if (_dir_index[i].hash != h || fno < 0 || (found >= 0 && fno > found)) continue;
+				file_desc cfd;
+				if (read_file_desc(fno, cfd) && !strncmp(cfd.name, name, name_size)) {
+					found = fno;
+					fd = cfd;
+				}
+			}
+			return found;
+		}
+		#endif
 		_dir.seek(4);
 		for (int fileno = 0; true; fileno++) {
 			if(_dir.read((char*)&fd, sizeof(fd)) < (int)sizeof(fd)) return -1;
 			if (fd.name[0] == minusone) return -1;
-			if (!strncmp(fd.name, name, TFS_NAME_SIZE)) return fileno;
+			if (!strncmp(fd.name, name, name_size) && !is_pending(fd)) return fileno;
 		}
 	}
 
-	short find_variable_end(block_t bl)
+	// data end is after last byte which is not 0xff, scanned backwards from
+	// limit a word at a time
+	// direct (handle with own buffer, read may hold shared lock) reads flash
+	// to stack instead of shared cache unless block has pending write
+	short find_variable_end(block_t bl, short limit = block_size, bool direct = false)
 	{
-		flush_write_cache();
-		_c_block.invalidate();
-		bool first = true;
-		for (short offs = TFS_PAGE_SIZE - TFS_CACHE_SIZE; offs; offs -= TFS_CACHE_SIZE) {
-			flash_read(bl.no()*TFS_PAGE_SIZE + offs, (unsigned int*)_cache, TFS_CACHE_SIZE);
-			short i = TFS_CACHE_SIZE - (first ? 2 : 0);
-			char *c = _cache + i;
-			for (; i; i--)
-				if (*(--c) != minusone) return offs + i;
+		if (limit > block_size) limit = block_size;
+		if (_w_block.valid() && _w_block == bl) direct = false;
+		unsigned int align4 w[16];
+		short step = (direct ? (short)sizeof(w) : (short)cache_size);
+		for (short offs = (limit - 1) & ~(step - 1); offs >= 0; offs -= step) {
+			short i = step;
+			unsigned char *c = (unsigned char *)w;
+			if (direct) read_flash(flash_addr(bl.no()*page_size + offs), w, step);
+			else c = (unsigned char *)get_cache(bl, offs, i);
+			if (offs + i > limit) i = limit - offs;
+			for (; i & 3; i--)
+				if (c[i - 1] != 0xff) return offs + i;
+			for (; i; i -= 4)
+				if (((unsigned int *)c)[(i >> 2) - 1] != 0xffffffff) {
+					while (c[i - 1] == 0xff) i--;
+					return offs + i;
+				}
 		}
 		return 0;
 	}
 
 	void open(file_desc &fd, File &f, short fileno = 0)
 	{
+		// own buffer stays attached to the handle
+		f.drop_buffer();
+		f._fs = this;
 		f._curblock = f._firstblock = fd.first_block;
 		f._offset = f._curblock_no = f._fboffs = 0;
 		f._lastblsize = fd.size;
 		f._fileno = fileno;
+		f._dir_gen = _dir_gen;
+		f._ring = (fd.size < 0 && (fd.size & TFS_RING_NONE) != TFS_RING_NONE ? fd.size & TFS_RING_NONE : 0);
+		f._chain = 0;
+		if (is_packed(fd)) {
+			// view of slot in shared block
+			short offs = fd.size & 0x3fff;
+			f._curblock.set(fd.first_block.no());
+			f._firstblock = f._lastbl = f._curblock;
+			f._fboffs = f._offset = offs + 4;
+			f._lastblsize = offs + 4 + pack_header(f._curblock, offs).s.s1;
+			f._lastbl_no = 0;
+			f._endhint = page_size;
+			return;
+		}
+		// chain is walked to the last block only when it is needed
+		f._lastbl.invalidate();
+		if (f._curblock.valid()) f.check_tail();
+	}
 
-		for (block_t bl = f._curblock; bl.valid(); bl = get_next_block(bl)) f._lastbl = bl;
-		if (fd.size == -1) {
-			// non fixed file find end
-			f._lastblsize = find_variable_end(f._lastbl);
+	void set_tail(File &f, block_t bl, short no)
+	{
+		for (block_t nbl; (nbl = get_next_block(bl)).valid(); bl = nbl) {
+			TFS_STAT(TFS_ADD(_stats.chain_steps, 1));
+			no++;
+		}
+		f._lastbl = bl;
+		f._lastbl_no = no;
+		f._endhint = page_size;
+		if (f._lastblsize < 0) {
+			// non fixed file find end, bound is kept only while file has one block
+			if (bl == f._firstblock) f._endhint = end_hint(f._lastblsize);
+			f._lastblsize = find_variable_end(bl, f._endhint, f._buf);
 		}
 	}
 
@@ -668,68 +2269,327 @@ protected:
 
 	bool defrag_dir_file()
 	{
+		TFS_STAT(TFS_ADD(_stats.dir_defrags, 1));
 		File nd;
+		nd._fs = this;
 		if (!new_write_block(nd._firstblock, TFS_BLF_SYSTEM)) return false;
 		nd._curblock = nd._lastbl = nd._firstblock;
-		nd._offset = nd._curblock_no = nd._fboffs = 0;
+		nd._offset = nd._curblock_no = nd._fboffs = nd._lastbl_no = nd._ring = 0;
+		nd._chain = 0;
 		nd._lastblsize = 4;
+		nd._endhint = page_size;
 
 		file_desc fd;
 		_next_file = 0;
+		#ifdef TFS_USE_DIR_INDEX
+			dir_index_reset();
+		#endif
 		_dir.seek(4);
 		while (true) {
 			if (_dir.read((char*)&fd, sizeof(fd)) < (int)sizeof(fd)) break;
 			if (fd.name[0] == minusone) break;
 			if (!fd.name[0]) continue;
 			nd.write((char*)&fd, sizeof(fd));
+			#ifdef TFS_USE_DIR_INDEX
+				if (!is_pending(fd)) dir_index_add(fd.name, _next_file);
+			#endif
 			_next_file++;
 		}
 
-		unsigned int align4 l = TFS_MAGIC;
-		flash_write(flash_addr(nd._firstblock.no()*TFS_PAGE_SIZE), &l, 4);
+		unsigned int align4 l = dir_magic;
+		program(nd._firstblock.no()*page_size, &l, 4);
 		l = 0;
-		flash_write(flash_addr(_dir._firstblock.no()*TFS_PAGE_SIZE), &l, 4);
+		program(_dir._firstblock.no()*page_size, &l, 4);
+		// head is system block, rest of old directory is normal chain
+		block_t rest = get_next_block(_dir._firstblock);
 		write_block_desc(_dir._firstblock, 0);
 		_free_blocks++;
+		retire_chain(rest);
 		_no_del_files = 0;
 
-		memcpy(&_dir, &nd, sizeof(nd));
+		_dir = nd;
+		_dir_gen++;
 		return true;
 	}
 
-	bool do_create(file_desc &fd, File &f)
+	// blocks of directory without deleted entries
+	short dir_live_blocks()
 	{
-		if (_dir._lastblsize + sizeof(fd) >= TFS_BLOCK_SIZE) {
-			// should defrag dir if there is space to do so
-			_dir.seek(TFS_SEEK_END);
-			if((_no_del_files ?	(_dir.position() + TFS_BLOCK_SIZE - 1) / TFS_BLOCK_SIZE :
-								(_dir.position() + sizeof(fd) + TFS_BLOCK_SIZE - 1) / TFS_BLOCK_SIZE) < _free_blocks) 
-				 defrag_dir_file();
-			// or space to expand dir plus block for file
-			else if (_free_blocks < 2) return false;
-		}
-		// need one block for new file
-		if (_free_blocks < 1) return false;
-		if (!new_write_block(fd.first_block)) return false;
-		fd.size = -1;
-		f._fileno = _next_file++;
+		return (4 + (_next_file - _no_del_files) * sizeof(file_desc) + block_size - 1) / block_size;
+	}
+
+	// directory can be compacted (it is done by step())
+	bool dir_defrag_needed()
+	{
+		return _no_del_files >= TFS_DIR_DEFRAG && dir_live_blocks() < _free_blocks;
+	}
+
+	// space for new directory entry, next one goes to new block
+	short dir_grow()
+	{
+		return (_dir._lastblsize + sizeof(file_desc) >= block_size ? 1 : 0);
+	}
+
+	// make space for new directory entry and given number of blocks, full
+	// directory grows by a block, it is compacted here only if there is no
+	// block left to grow or step() wasn't called to do it in time
+	bool dir_space(short blocks)
+	{
+		if (dir_grow() && _no_del_files && dir_live_blocks() < _free_blocks &&
+			(_no_del_files >= 2 * TFS_DIR_DEFRAG || _free_blocks < blocks + 1))
+			defrag_dir_file();
+		return _free_blocks >= blocks + dir_grow();
+	}
+
+	short add_dir_entry(file_desc &fd)
+	{
+		short fno = _next_file++;
 		_dir.write((char*)&fd, sizeof(fd));
 		flush_write_cache();
-		f._curblock = f._firstblock = f._lastbl = fd.first_block;
-		f._offset = f._curblock_no = f._fboffs = 0;
+		#ifdef TFS_USE_DIR_INDEX
+			if (!is_pending(fd)) dir_index_add(fd.name, fno);
+		#endif
+		return fno;
+	}
+
+	bool do_create(file_desc &fd, File &f, short ring = TFS_RING_NONE, unsigned short flags = 0)
+	{
+		// need one block for new file
+		block_t bl;
+		f.drop_buffer();
+		f._fs = this;
+		if (!dir_space(1)) return false;
+		if (!new_write_block(bl)) return false;
+		fd.first_block.set(bl.no() | flags);
+		// bound starts at first part of block if there is more than one
+		fd.size = (short)(((hint_bits > 1 ? ~(1 << hint_shift) : ~0) & ~TFS_RING_NONE) | ring);
+		f._fileno = add_dir_entry(fd);
+		f._dir_gen = _dir_gen;
+		f._curblock = f._firstblock = f._lastbl = bl;
+		f._offset = f._curblock_no = f._fboffs = f._lastbl_no = 0;
 		f._lastblsize = 0;
+		f._endhint = (hint_bits > 1 ? hint_unit : page_size);
+		f._ring = (ring == TFS_RING_NONE ? 0 : ring);
+		f._chain = 0;
+		return true;
+	}
+
+	// fixed size is programmed over variable one if it needs no bits cleared
+	// (end hint never clears them, ring limit does), otherwise entry is added
+	// again with it in the same way as ring_recycle() does (shadow entry stays
+	// uncommitted), returns false if there is no space and file stays variable
+	bool fix_size(File &f, short size)
+	{
+		file_desc fd;
+		short ofno = file_entry(f);
+		if (!read_file_desc(ofno, fd)) return false;
+		if (!(size & ~fd.size)) {
+			do_fix_size(ofno, size);
+			return true;
+		}
+		if (!dir_space(0)) return false;
+		// directory could be compacted
+		ofno = file_entry(f);
+		bool shadow = is_pending(fd);
+		fd.first_block.set(fd.first_block.get() | TFS_PENDING);
+		fd.size = size;
+		short fno = add_dir_entry(fd);
+		#ifdef TFS_USE_DIR_INDEX
+			if (!shadow) dir_index_remove(fd.name, ofno);
+		#endif
+		clear_entry(ofno);
+		f._fileno = fno;
+		if (shadow) return true;
+		commit_entry(fno, fd);
+		#ifdef TFS_USE_DIR_INDEX
+			dir_index_add(fd.name, fno);
+		#endif
+		return true;
+	}
+
+	// move head of full ring file to its second block: new pending entry is
+	// added, old one cleared, pending committed and only then old head is dirty
+	// added entry needs no more than block to grow directory, it is never
+	// compacted here (step() does it), so this is done by write in bounded
+	// time, returns false if there is no space
+	bool ring_recycle(File &f)
+	{
+		block_t head = f._firstblock, next = get_next_block(head);
+		file_desc fd;
+		if (!next.valid() || !read_file_desc(file_entry(f), fd) || _free_blocks < dir_grow()) return false;
+		fd.first_block.set(next.no() | TFS_PENDING);
+		fd.size |= hint_mask; // bound was kept for old head only
+		short fno = add_dir_entry(fd);
+		short ofno = file_entry(f);
+		#ifdef TFS_USE_DIR_INDEX
+			dir_index_remove(fd.name, ofno);
+		#endif
+		clear_entry(ofno);
+		commit_entry(fno, fd);
+		#ifdef TFS_USE_DIR_INDEX
+			dir_index_add(fd.name, fno);
+		#endif
+		write_block_desc(head, 0);
+		_free_blocks++;
+
+		f._firstblock = next;
+		f._fileno = fno;
+		f._lastbl_no--;
+		if (f._curblock == head) {
+			f._curblock = next;
+			f._offset = 0;
+		}
+		else f._curblock_no--;
+		if (f._chain) f.set_chain_index(f._chain, f._chain_size, f._chain_step);
+		return true;
+	}
+
+	long_short pack_header(block_t bl, short offs)
+	{
+		long_short ls;
+		short cs;
+		memcpy(&ls, get_cache(bl, offs, cs), 4);
+		return ls;
+	}
+
+	// walk slots of pack block, returns offset after the last one and bytes
+	// used by live slots (with headers)
+	short pack_walk(block_t bl, short &live)
+	{
+		short offs = 0;
+		live = 0;
+		while (offs + 4 < block_size) {
+			long_short ls = pack_header(bl, offs);
+			if (ls.s.s1 == 0xffff) break;
+			if (ls.s.s2) live += 4 + ls.s.s1;
+			offs += (4 + ls.s.s1 + 3) & ~3;
+		}
+		return offs;
+	}
+
+	// write slot with data from buf or src file to pack block and point fd to it
+	bool pack_slot(file_desc &fd, File *src, const char *buf, short size)
+	{
+		short live;
+		if (_pack.valid() && _pack_used < 0) _pack_used = pack_walk(_pack, live);
+		if (!_pack.valid() || _pack_used + 4 + size >= block_size) {
+			if (!new_write_block(_pack)) {
+				_pack.invalidate();
+				return false;
+			}
+			_pack_used = 0;
+		}
+		File f;
+		f._fs = this;
+		f._curblock = f._firstblock = f._lastbl = _pack;
+		f._offset = f._curblock_no = f._fboffs = f._lastbl_no = f._ring = 0;
+		f._lastblsize = _pack_used;
+		f._endhint = page_size;
+		f._chain = 0;
+		long_short ls;
+		ls.s.s1 = size;
+		ls.s.s2 = 0xffff;
+		f.write((char*)&ls, 4);
+		if (src) {
+			char b[32];
+			for (int n; (n = src->read(b, sizeof(b))) > 0; ) f.write(b, n);
+		}
+		else f.write(buf, size);
+		f.close();
+		fd.first_block = _pack;
+		fd.size = TFS_PACKED | _pack_used;
+		_pack_used = (_pack_used + 4 + size + 3) & ~3;
+		return true;
+	}
+
+	// free space of removed entry, slot of packed file is marked dead and
+	// its block is made dirty when no live slot is left
+	void release(file_desc &fd)
+	{
+		if (!is_packed(fd)) {
+			retire_chain(fd.first_block);
+			return;
+		}
+		block_t bl;
+		bl.set(fd.first_block.no());
+		long_short align4 ls;
+		ls.l = 0xffffffff;
+		ls.s.s2 = 0;
+		program(bl.no()*page_size + (fd.size & 0x3fff), &ls.l, 4);
+		short live;
+		pack_walk(bl, live);
+		if (live) return;
+		if (_pack.valid() && bl == _pack) _pack.invalidate();
+		if (get_next_block(bl).flag() == TFS_BLF_NORMAL) {
+			write_block_desc(bl, 0);
+			_free_blocks++;
+		}
+	}
+
+	// store file in pack block, existing file with the same name is replaced
+	// as in shadow commit: new entry is pending until old one is cleared
+	bool pack_file(file_desc &fd, File *src, const char *buf, short size)
+	{
+		file_desc ofd;
+		if (!dir_space(1)) return false;
+		short ofno = find_file_desc(fd.name, ofd);
+		if (!pack_slot(fd, src, buf, size)) return false;
+		if (ofno >= 0) fd.first_block.set(fd.first_block.get() | TFS_PENDING);
+		short fno = add_dir_entry(fd);
+		if (ofno >= 0) {
+			#ifdef TFS_USE_DIR_INDEX
+				dir_index_remove(fd.name, ofno);
+			#endif
+			clear_entry(ofno);
+			commit_entry(fno, fd);
+			#ifdef TFS_USE_DIR_INDEX
+				dir_index_add(fd.name, fno);
+			#endif
+			release(ofd);
+		}
+		flush_write_cache();
 		return true;
 	}
 
+	// copy file leaving out runs of zeroes of at least min_run bytes, without
+	// dst only counts them, returns number of bytes left out or -1
+	int copy_live(File &src, File *dst, short min_run)
+	{
+		char buf[128];
+		int dropped = 0, zeros = 0, n;
+		src.seek(0);
+		while ((n = src.read(buf, sizeof(buf))) > 0) {
+			for (int i = 0, j; i < n; i = j) {
+				j = i;
+				if (!buf[i]) {
+					while (j < n && !buf[j]) j++;
+					zeros += j - i;
+					continue;
+				}
+				while (j < n && buf[j]) j++;
+				// shorter run of zeroes is part of live data
+				if (zeros >= min_run) dropped += zeros;
+				else if (zeros && dst && dst->write(0, zeros) != zeros) return -1;
+				zeros = 0;
+				if (dst && dst->write(buf + i, j - i) != j - i) return -1;
+			}
+		}
+		if (zeros >= min_run) dropped += zeros;
+		else if (zeros && dst && dst->write(0, zeros) != zeros) return -1;
+		return dropped;
+	}
+
 public:
 	bool open(const char *name, File &f, bool create_if_not_exist = false)
 	{
+		TFS_LOCK;
+		TFS_TIME(TFS_OP_OPEN);
 		if (!*name || *name == minusone) return false;
 		file_desc fd;
 		short fileno = find_file_desc(name, fd);
 		if (fileno == -1) {
 			if(!create_if_not_exist) return false;
-			strncpy(fd.name, name, TFS_NAME_SIZE);
+			copy_name(fd.name, name);
 			return do_create(fd, f);
 		}
 
@@ -739,6 +2599,7 @@ public:
 
 	int get_size(const char *name)
 	{
+		TFS_LOCK;
 		file_desc fd;
 		if(find_file_desc(name, fd) == -1) return -1;
 		return do_get_size(fd);
@@ -746,105 +2607,310 @@ public:
 
 	bool create(const char *name, File &f)
 	{
+		TFS_LOCK;
+		TFS_TIME(TFS_OP_CREATE);
 		if (!*name || *name == minusone) return false;
 		remove(name);
 		file_desc fd;
-		strncpy(fd.name, name, TFS_NAME_SIZE);
+		copy_name(fd.name, name);
 		return do_create(fd, f);
 	}
 
+	// create ring file which keeps at most max_blocks (2 - 2046) blocks, when
+	// it is full, writing to new block drops the oldest one, records up to
+	// block size are not split between blocks
+	bool create_ring(const char *name, File &f, short max_blocks)
+	{
+		TFS_LOCK;
+		if (!*name || *name == minusone || max_blocks < 2 || max_blocks >= TFS_RING_NONE) return false;
+		remove(name);
+		file_desc fd;
+		copy_name(fd.name, name);
+		return do_create(fd, f, max_blocks);
+	}
+
+	// create file which replaces existing one with the same name when
+	// replace() is called, until then open() finds old content, if it is
+	// not replaced, it is dropped by next init()
+	bool create_shadow(const char *name, File &f)
+	{
+		TFS_LOCK;
+		if (!*name || *name == minusone) return false;
+		file_desc fd;
+		copy_name(fd.name, name);
+		return do_create(fd, f, TFS_RING_NONE, TFS_PENDING | TFS_SHADOW);
+	}
+
+	// close shadow file and swap it for existing file in one directory update,
+	// if interrupted after commit started init() finishes it
+	bool replace(File &f, bool fixed = false)
+	{
+		TFS_LOCK;
+		file_desc fd, ofd;
+		if (!f._curblock.valid()) return false;
+		f.flush();
+		flush_write_cache();
+		short fno = file_entry(f);
+		if (!read_file_desc(fno, fd) || (fd.first_block.get() & (TFS_PENDING | TFS_SHADOW)) != (TFS_PENDING | TFS_SHADOW)) return false;
+		if (fixed) {
+			fix_size(f, f._lastblsize);
+			fno = file_entry(f);
+			read_file_desc(fno, fd);
+		}
+		f._curblock.invalidate();
+
+		fd.first_block.set(fd.first_block.get() & ~TFS_SHADOW);
+		dir_program(fno, name_size, fd.first_block.get(), 2);
+		short ofno = find_file_desc(fd.name, ofd);
+		if (ofno >= 0) {
+			#ifdef TFS_USE_DIR_INDEX
+				dir_index_remove(fd.name, ofno);
+			#endif
+			clear_entry(ofno);
+		}
+		commit_entry(fno, fd);
+		#ifdef TFS_USE_DIR_INDEX
+			dir_index_add(fd.name, fno);
+		#endif
+		if (ofno >= 0) release(ofd);
+		flush_write_cache();
+		return true;
+	}
+
+	// write small fixed size file which shares block with other packed files,
+	// existing file with the same name is replaced
+	bool write_packed(const char *name, const char *buf, short size)
+	{
+		TFS_LOCK;
+		if (!*name || *name == minusone || size < 0 || size > TFS_PACK_MAX) return false;
+		file_desc fd;
+		copy_name(fd.name, name);
+		return pack_file(fd, 0, buf, size);
+	}
+
+	// move packed files out of pack blocks which are at least half free so
+	// those blocks are made dirty, returns number of freed blocks
+	short compact_packed()
+	{
+		TFS_LOCK;
+		short n = 0;
+		file_desc fd;
+		block_t bl, last;
+		last.set(0xffff);
+		for (short fno = 0; fno < _next_file; fno++) {
+			if (!read_file_desc(fno, fd) || !fd.name[0] || is_pending(fd) || !is_packed(fd)) continue;
+			bl.set(fd.first_block.no());
+			if (bl == last || (_pack.valid() && bl == _pack)) continue;
+			last = bl;
+			short live, used = pack_walk(bl, live);
+			if (live * 2 > used) continue;
+
+			// files are moved one by one, directory could be defragmented meanwhile
+			for (short i = 0; i < _next_file; i++) {
+				if (!read_file_desc(i, fd) || !fd.name[0] || is_pending(fd) || !is_packed(fd) || fd.first_block.no() != bl.no()) continue;
+				File src;
+				open(fd, src, i);
+				if (!pack_file(fd, &src, 0, src._lastblsize - src._fboffs)) return n;
+				i = -1;
+			}
+			// slots without entry left after interruption
+			if (get_next_block(bl).flag() == TFS_BLF_NORMAL) {
+				write_block_desc(bl, 0);
+				_free_blocks++;
+			}
+			n++;
+			fno = -1;
+		}
+		return n;
+	}
+
+	// rewrite file without runs of zeroes (left by File::erase) of at least
+	// min_run bytes through shadow file, so blocks they occupy are freed, it is
+	// done only if file gets shorter by a block, file must not be open,
+	// returns number of bytes left out, 0 if not rewritten or -1
+	int compact(const char *name, short min_run = 1)
+	{
+		TFS_LOCK;
+		file_desc fd, sfd;
+		if (min_run < 1 || find_file_desc(name, fd) == -1 || is_packed(fd)) return -1;
+		File src, dst;
+		open(fd, src);
+		if (src._ring) return -1;
+		src.seek(TFS_SEEK_END);
+		int size = src.position();
+		int dropped = copy_live(src, 0, min_run);
+		if (dropped < 0 || (size - dropped + block_size - 1) / block_size >= (size + block_size - 1) / block_size) return 0;
+		if (!create_shadow(name, dst)) return -1;
+		if (copy_live(src, &dst, min_run) != dropped) {
+			// not enough space, shadow is dropped
+			short fno = file_entry(dst);
+			dst.close();
+			if (read_file_desc(fno, sfd)) {
+				clear_entry(fno);
+				flush_write_cache();
+				release(sfd);
+			}
+			return -1;
+		}
+		src.close();
+		return replace(dst, fd.size >= 0) ? dropped : -1;
+	}
+
 	void remove(const char *name)
 	{
+		TFS_LOCK;
+		TFS_TIME(TFS_OP_REMOVE);
 		file_desc fd;
 		int fno = find_file_desc(name, fd);
 		if (fno == -1) return;
 
-		_dir.seek(4 + fno * sizeof(file_desc));
-		block_t bl = _dir._curblock;
-		short offs = _dir._offset;
-		long_short align4 ls;
-		ls.l = 0xffffffff;
-		ls.c.c1 = 0;
-		flash_write(flash_addr(bl.no()*TFS_PAGE_SIZE + offs), &ls.l, 4);
+		clear_entry(fno);
 		flush_write_cache();
-		_c_block.invalidate();
-		_no_del_files++;
+		#ifdef TFS_USE_DIR_INDEX
+			dir_index_remove(name, fno);
+		#endif
 
-		while(1) {
-			block_t lb, nbl, bl = fd.first_block;
-			lb.set(-1);
-			while (1) {
-				nbl = get_next_block(bl);
-				if (nbl.flag() != TFS_BLF_NORMAL) break;
-				lb = bl;
-				bl = nbl;
-				if (!bl.valid()) break;
-			}
-			if (!lb.valid()) break;
-			write_block_desc(lb, 0);
-			_free_blocks++;
-		}
+		release(fd);
 	}
 
 	bool exists(const char *name)
 	{
+		TFS_LOCK;
 		file_desc fd;
-		return find_file_desc(name,fd) > 0;
+		return find_file_desc(name,fd) >= 0;
 	}
 
 	int freespace()
 	{
-		return _free_blocks*TFS_BLOCK_SIZE;
+		return _free_blocks*block_size;
+	}
+
+	// read cache hit and miss counters, to help sizing cache_lines
+	void cache_stats(unsigned int &hits, unsigned int &misses, bool reset = false)
+	{
+		TFS_LOCK;
+		hits = _c_hits;
+		misses = _c_misses;
+		if (reset) _c_hits = _c_misses = 0;
+	}
+
+#ifdef TFS_USE_STATS
+	// copy of counters, reset clears them and those of cache_stats() and write_stats()
+	void stats(stats_t &s, bool reset = false)
+	{
+		TFS_LOCK;
+		_stats.cache_hits = _c_hits;
+		_stats.cache_misses = _c_misses;
+		_stats.wc_programs = _w_programs;
+		memcpy(&s, &_stats, sizeof(s));
+		if (reset) {
+			memset(&_stats, 0, sizeof(_stats));
+			_c_hits = _c_misses = _w_programs = _w_saved = 0;
+		}
+	}
+#endif
+
+	// write cache counters, number of programs done and of writes merged to
+	// pending program instead of needing own one
+	void write_stats(unsigned int &programs, unsigned int &saved, bool reset = false)
+	{
+		TFS_LOCK;
+		programs = _w_programs;
+		saved = _w_saved;
+		if (reset) _w_programs = _w_saved = 0;
 	}
 
-	bool process_erase()
+	// erase one dirty block, bulk allows group erase (slower than one sector)
+	bool process_erase(bool bulk = true)
 	{
+		TFS_LOCK;
 		// if no dirty return fail
 		block_t bl;
+		#ifdef TFS_USE_ASYNC_ERASE
+			erase_wait();
+		#endif
 		if (!find_block_with_flag(bl, TFS_BLF_DIRTY)) return false;
-		flash_erase_sector(flash_sector(bl.no()));
-		set_last_block_erased((_last_block_erased = bl.no()));
+		#ifdef TFS_USE_CHECKPOINT
+			if (_cp_valid) cp_invalidate();
+		#endif
+		#ifdef TFS_USE_BULK_ERASE
+			if (bulk && erase_group(bl.no())) return true;
+		#else
+			(void)bulk;
+		#endif
+		erase_start(bl);
 		return true;
 	}
 
+	// erase dirty blocks while CPU is idle, at most max_blocks or until
+	// expired() returns true, returns number of erased blocks
+	short erase_idle(short max_blocks = 1, bool (*expired)() = 0)
+	{
+		TFS_LOCK;
+		short n = 0;
+		while (n < max_blocks && !(expired && expired()) && process_erase()) n++;
+		return n;
+	}
+
+	// true if there are less than TFS_ERASE_RESERVE erased blocks left and
+	// write may have to erase inline
+	bool erase_needed()
+	{
+		return _erased_blocks < TFS_ERASE_RESERVE && _erased_blocks < _free_blocks;
+	}
+
+	int erased_space()
+	{
+		return _erased_blocks*block_size;
+	}
+
 	class Dir {
-		friend TFS;
+		friend TFS_T;
 	protected:
+		TFS_T *_fs;
 		file_desc _fd;
 		short _fileno;
 		bool _valid;
 
 	public:
-		Dir() : _fileno(0) { _valid = false; }
+		// without argument lists last initialized instance of this config
+		Dir() : _fs(_instance), _fileno(0) { _valid = false; }
+		Dir(TFS_T &fs) : _fs(&fs), _fileno(0) { _valid = false; }
 		bool isfixed() { return _valid ? (_fd.size >= 0) : false; }
 
 		bool next()
 		{
-			_valid = tfs._dir.seek(4 + _fileno * sizeof(_fd));
+			TFS_LOCK;
+			if (!_fs) return (_valid = false);
+			_valid = _fs->_dir.seek(4 + _fileno * sizeof(_fd));
 			if (!_valid) return false;
 			while (1) {
-				_valid = tfs._dir.read((char*)&_fd, sizeof(_fd)) == (int)sizeof(_fd);
+				_valid = _fs->_dir.read((char*)&_fd, sizeof(_fd)) == (int)sizeof(_fd);
 				_fileno++;
 				if (!_valid) return false;
-				if (_fd.name[0]) return (_valid = (_fd.name[0] != minusone));
+				if (_fd.name[0] && !is_pending(_fd)) return (_valid = (_fd.name[0] != minusone));
 			}
 		}
 
 		bool get_name(char *buf)
 		{
 			if (!_valid) return false;
-			memcpy(buf, _fd.name, TFS_NAME_SIZE);
-			buf[TFS_NAME_SIZE] = 0;
+			memcpy(buf, _fd.name, name_size);
+			buf[name_size] = 0;
 			return true;
 		}
 
 		int get_size() {
+			TFS_LOCK;
 			if (!_valid) return -1;
-			return tfs.do_get_size(_fd);
+			return _fs->do_get_size(_fd);
 		}
 	};
 
 	friend Dir;
 };
 
+template <class C> TFS_T<C> *TFS_T<C>::_instance;
+
+typedef TFS_T<tfs_config> TFS;
 extern TFS tfs;
@@ -0,0 +1,420 @@
+// Twilight File System - key-value store
+//
+// keys and values are appended to variable size file as framed records,
+// record which is replaced or removed is zeroed in place (File::erase), RAM
+// hash index keeps position of every live record, so get() reads only it,
+// open() loads index in one pass over the file, store is rewritten through
+// shadow file when dead records take more space than live ones
+//
+// file starts with magic, record: tag, key length, value length (2 bytes, little endian), key, value,
+// fletcher-16 of all that (2 bytes, neither is 0xff so file keeps its size)
+//
+// Copyright(C) 2017. Nebojsa Sumrak <nsumrak@yahoo.com>
+//
+//   This program is free software; you can redistribute it and / or modify
+//	 it under the terms of the GNU General Public License as published by
+//	 the Free Software Foundation; either version 2 of the License, or
+//	 (at your option) any later version.
+//
+//	 This program is distributed in the hope that it will be useful,
+//	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+//	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+//	 GNU General Public License for more details.
+//
+//	 You should have received a copy of the GNU General Public License along
+//	 with this program; if not, write to the Free Software Foundation, Inc.,
+//	 51 Franklin Street, Fifth Floor, Boston, MA 02110 - 1301 USA.
+
+#pragma once
+
+#include "tfs.h"
+
+// maximum key and value size
+#ifndef TFS_KV_KEY_MAX
+#define TFS_KV_KEY_MAX		32
+#endif
+
+#ifndef TFS_KV_VALUE_MAX
+#define TFS_KV_VALUE_MAX	1024
+#endif
+
+// number of index entries (power of 2, 8 bytes each), store holds up to 3/4
+// of it keys
+#ifndef TFS_KV_INDEX_SIZE
+#define TFS_KV_INDEX_SIZE	64
+#endif
+
+#if (TFS_KV_INDEX_SIZE & (TFS_KV_INDEX_SIZE - 1))
+#error "TFS key-value index size must be power of 2"
+#endif
+
+#if (TFS_KV_KEY_MAX < 1 || TFS_KV_KEY_MAX > 255 || TFS_KV_VALUE_MAX > 0xffff - 6 - TFS_KV_KEY_MAX)
+#error "TFS key-value key or value size out of range"
+#endif
+
+// put() and remove() compact store when dead records take at least this many
+// bytes and more than live ones
+#ifndef TFS_KV_COMPACT
+#define TFS_KV_COMPACT		4096
+#endif
+
+#define TFS_KV_MAGIC	"tkv1"
+#define TFS_KV_TAG		0x6b
+
+template <class FS> class TFS_KV_T
+{
+public:
+	enum {
+		magic_size = 4,
+		header_size = 4,
+		check_size = 2,
+		index_mask = TFS_KV_INDEX_SIZE - 1
+	};
+
+	TFS_KV_T() : _fs(0)
+	{
+	}
+
+	~TFS_KV_T()
+	{
+		close();
+	}
+
+	// open store (created if it doesn't exist) and load its index, records
+	// left invalid by interruption and older copies of the same key are zeroed,
+	// file which doesn't start with store magic isn't touched and false is
+	// returned
+	bool open(FS &fs, const char *name)
+	{
+		close();
+		if (!fs.open(name, _fh, true)) return false;
+		_fs = &fs;
+		strncpy(_name, name, FS::name_size);
+		_name[FS::name_size] = 0;
+		if (!load()) {
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	void close()
+	{
+		if (!_fs) return;
+		_fh.close();
+		_fs = 0;
+	}
+
+	bool isopen()
+	{
+		return _fs != 0;
+	}
+
+	// copy value of key to buf (at most size bytes), returns size of value
+	// or -1 if key is not found
+	int get(const char *key, void *buf, int size)
+	{
+		int klen = key_len(key);
+		if (!_fs || !klen) return -1;
+		int ins, i = find(key, klen, hash(key, klen), ins);
+		if (i < 0) return -1;
+		int vlen = _index[i].size - header_size - klen - check_size;
+		if (size > vlen) size = vlen;
+		if (size > 0 && (!_fh.seek(_index[i].pos + header_size + klen) || _fh.read((char *)buf, size) != size)) return -1;
+		return vlen;
+	}
+
+	bool exists(const char *key)
+	{
+		int klen = key_len(key), ins;
+		return _fs && klen && find(key, klen, hash(key, klen), ins) >= 0;
+	}
+
+	// append new record of key, older one is zeroed only after that, so
+	// if interrupted open() finds one of them
+	bool put(const char *key, const void *value, int size)
+	{
+		int klen = key_len(key);
+		if (!_fs || !klen || size < 0 || size > TFS_KV_VALUE_MAX) return false;
+		unsigned short h = hash(key, klen);
+		int ins = -1, i = find(key, klen, h, ins);
+		if (i < 0 && _used >= TFS_KV_INDEX_SIZE * 3 / 4) return false;
+
+		unsigned char hdr[header_size] = { TFS_KV_TAG, (unsigned char)klen, (unsigned char)size, (unsigned char)(size >> 8) };
+		unsigned short sum1 = 0, sum2 = 0;
+		fletcher(sum1, sum2, hdr, header_size);
+		fletcher(sum1, sum2, key, klen);
+		fletcher(sum1, sum2, value, size);
+		unsigned char chk[check_size] = { (unsigned char)sum1, (unsigned char)sum2 };
+		int rsize = header_size + klen + size + check_size;
+		int n = _fh.write((const char *)hdr, header_size);
+		if (n == header_size) n += _fh.write(key, klen);
+		if (n == header_size + klen) n += _fh.write((const char *)value, size);
+		if (n == rsize - check_size) n += _fh.write((const char *)chk, check_size);
+		if (n != rsize) {
+			// partial record is dead, open() zeroes it
+			if (n > 0) {
+				_size += n;
+				_dead += n;
+			}
+			return false;
+		}
+
+		if (i >= 0) drop(i);
+		else {
+			i = ins;
+			_used++;
+		}
+		_index[i].pos = _size;
+		_index[i].hash = h;
+		_index[i].size = rsize;
+		_size += rsize;
+		_live += rsize;
+		if (compact_needed()) compact();
+		return true;
+	}
+
+	bool remove(const char *key)
+	{
+		int klen = key_len(key);
+		if (!_fs || !klen) return false;
+		int ins, i = find(key, klen, hash(key, klen), ins);
+		if (i < 0) return false;
+		drop(i);
+		index_remove(i);
+		if (compact_needed()) compact();
+		return true;
+	}
+
+	// iterate keys, starting with -1, returns -1 after the last one
+	int next(int it, char *key)
+	{
+		if (!_fs) return -1;
+		while (++it < TFS_KV_INDEX_SIZE) {
+			if (_index[it].pos < 0) continue;
+			unsigned char hdr[header_size];
+			if (!_fh.seek(_index[it].pos) || _fh.read((char *)hdr, header_size) != header_size || _fh.read(key, hdr[1]) != hdr[1]) return -1;
+			key[hdr[1]] = 0;
+			return it;
+		}
+		return -1;
+	}
+
+	int count()
+	{
+		return _used;
+	}
+
+	// bytes of live and dead records
+	int live_size()
+	{
+		return _live;
+	}
+
+	int dead_size()
+	{
+		return _dead;
+	}
+
+	// rewrite live records to shadow file which replaces store, there has to
+	// be free space for them
+	bool compact()
+	{
+		if (!_fs || _live + 2 * FS::block_size > _fs->freespace()) return false;
+		typename FS::File dst;
+		if (!_fs->create_shadow(_name, dst) || dst.write(TFS_KV_MAGIC, magic_size) != magic_size) return false;
+		char buf[64];
+		for (int i = 0; i < TFS_KV_INDEX_SIZE; i++) {
+			if (_index[i].pos < 0) continue;
+			if (!_fh.seek(_index[i].pos)) return false;
+			for (int sz = _index[i].size, n; sz > 0; sz -= n) {
+				n = sz < (int)sizeof(buf) ? sz : (int)sizeof(buf);
+				// shadow which is not replaced is dropped by init()
+				if (_fh.read(buf, n) != n || dst.write(buf, n) != n) return false;
+			}
+		}
+		_fh.close();
+		bool ok = _fs->replace(dst);
+		if (!_fs->open(_name, _fh)) {
+			_fs = 0;
+			return false;
+		}
+		if (!ok) return false;
+		// records are in index order now
+		_size = magic_size;
+		for (int i = 0; i < TFS_KV_INDEX_SIZE; i++) {
+			if (_index[i].pos < 0) continue;
+			_index[i].pos = _size;
+			_size += _index[i].size;
+		}
+		_dead = 0;
+		return true;
+	}
+
+protected:
+	// open addressing hash of live records, linear probing
+	struct index_t {
+		int pos; // -1 empty
+		unsigned short hash;
+		unsigned short size; // of whole record
+	};
+	FS *_fs;
+	typename FS::File _fh;
+	char _name[FS::name_size + 1];
+	index_t _index[TFS_KV_INDEX_SIZE];
+	short _used;
+	int _size, _live, _dead;
+
+	static int key_len(const char *key)
+	{
+		int n = 0;
+		while (key[n]) if (++n > TFS_KV_KEY_MAX) return 0;
+		return n;
+	}
+
+	static unsigned short hash(const char *key, int len)
+	{
+		unsigned int h = 2166136261u;
+		for (int i = 0; i < len; i++)
+			h = (h ^ (unsigned char)key[i]) * 16777619u;
+		return (unsigned short)(h ^ (h >> 16));
+	}
+
+	// sums are modulo 255, so none of them is 0xff
+	static void fletcher(unsigned short &sum1, unsigned short &sum2, const void *data, int size)
+	{
+		const unsigned char *p = (const unsigned char *)data;
+		for (int i = 0; i < size; i++) {
+			sum1 = (sum1 + p[i]) % 255;
+			sum2 = (sum2 + sum1) % 255;
+		}
+	}
+
+	// slot of key, if not found -1 and ins is empty slot for it
+	int find(const char *key, int klen, unsigned short h, int &ins)
+	{
+		unsigned char rec[header_size + TFS_KV_KEY_MAX];
+		int i = h & index_mask;
+		for (; _index[i].pos >= 0; i = (i + 1) & index_mask) {
+			if (_index[i].hash != h || !_fh.seek(_index[i].pos)) continue;
+			if (_fh.read((char *)rec, header_size + klen) == header_size + klen && rec[1] == klen && !memcmp(rec + header_size, key, klen)) return i;
+		}
+		ins = i;
+		return -1;
+	}
+
+	// zero record of slot, it stays in index
+	void drop(int i)
+	{
+		_fh.erase(_index[i].pos, _index[i].size);
+		_live -= _index[i].size;
+		_dead += _index[i].size;
+	}
+
+	// entries after removed one are moved back, so lookups don't need deleted mark
+	void index_remove(int i)
+	{
+		for (int j = (i + 1) & index_mask; _index[j].pos >= 0; j = (j + 1) & index_mask) {
+			int k = _index[j].hash & index_mask;
+			// entry stays if its home slot is cyclically in (i, j]
+			if (i <= j ? (k > i && k <= j) : (k > i || k <= j)) continue;
+			_index[i] = _index[j];
+			i = j;
+		}
+		_index[i].pos = -1;
+		_used--;
+	}
+
+	bool compact_needed()
+	{
+		return _dead >= TFS_KV_COMPACT && _dead > _live;
+	}
+
+	// read rest of record which starts with hdr (n bytes of it read), key is
+	// copied to key, returns size of record or 0 if it is not valid
+	int read_record(unsigned char *hdr, int n, char *key)
+	{
+		int klen = hdr[1], vlen = hdr[2] | hdr[3] << 8;
+		if (n < header_size || hdr[0] != TFS_KV_TAG || !klen || klen > TFS_KV_KEY_MAX || vlen > TFS_KV_VALUE_MAX) return 0;
+		if (_fh.read(key, klen) != klen) return 0;
+		unsigned short sum1 = 0, sum2 = 0;
+		fletcher(sum1, sum2, hdr, header_size);
+		fletcher(sum1, sum2, key, klen);
+		char buf[64];
+		for (int sz = vlen, c; sz > 0; sz -= c) {
+			c = sz < (int)sizeof(buf) ? sz : (int)sizeof(buf);
+			if (_fh.read(buf, c) != c) return 0;
+			fletcher(sum1, sum2, buf, c);
+		}
+		unsigned char chk[check_size];
+		if (_fh.read((char *)chk, check_size) != check_size || chk[0] != sum1 || chk[1] != sum2) return 0;
+		key[klen] = 0;
+		return header_size + klen + vlen + check_size;
+	}
+
+	// one pass over the file, zeroed bytes are skipped, invalid ones (record
+	// torn by interruption) are zeroed once next valid record is found
+	bool load()
+	{
+		memset(_index, 0xff, sizeof(_index));
+		_used = 0;
+		_live = _dead = 0;
+		_fh.seek(TFS_SEEK_END);
+		_size = _fh.position();
+		_fh.seek(0);
+		if (!_size) {
+			_size = magic_size;
+			return _fh.write(TFS_KV_MAGIC, magic_size) == magic_size;
+		}
+		char magic[magic_size];
+		if (_fh.read(magic, magic_size) != magic_size || memcmp(magic, TFS_KV_MAGIC, magic_size)) return false;
+		int pos = magic_size, bad = -1;
+		unsigned char hdr[header_size];
+		char key[TFS_KV_KEY_MAX + 1];
+		while (true) {
+			int n = _fh.read((char *)hdr, header_size);
+			if (n <= 0) break;
+			int z = 0;
+			while (z < n && !hdr[z]) z++;
+			if (z) {
+				pos += z;
+				if (bad < 0) _dead += z;
+				if (z < n) _fh.seek(pos);
+				continue;
+			}
+			int rsize = read_record(hdr, n, key);
+			if (!rsize) {
+				if (bad < 0) bad = pos;
+				_fh.seek(++pos);
+				continue;
+			}
+			if (bad >= 0) {
+				_fh.erase(bad, pos - bad);
+				_dead += pos - bad;
+				bad = -1;
+			}
+			int klen = strlen(key), ins;
+			unsigned short h = hash(key, klen);
+			int i = find(key, klen, h, ins);
+			if (i >= 0) drop(i);
+			else if (_used >= TFS_KV_INDEX_SIZE * 3 / 4) return false;
+			else {
+				i = ins;
+				_used++;
+			}
+			_index[i].pos = pos;
+			_index[i].hash = h;
+			_index[i].size = rsize;
+			_live += rsize;
+			pos += rsize;
+			_fh.seek(pos);
+		}
+		if (bad >= 0) {
+			_fh.erase(bad, _size - bad);
+			_dead += _size - bad;
+		}
+		return true;
+	}
+};
+
+typedef TFS_KV_T<TFS> TFS_KV;